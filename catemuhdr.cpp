@@ -3,15 +3,52 @@
  * mGBA-style GUI with SDL2
  */
 
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <cmath>
 #include <fstream>
 #include <string>
 #include <iostream>
 #include <chrono>
+#include <coroutine>
+#include <functional>
 #include <thread>
 #include <cstdlib>
+#include <cstdarg>
+#include <cerrno>
 #include <vector>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <unordered_map>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CHIP8_HAVE_AVX 1
+#include <immintrin.h>
+#else
+#define CHIP8_HAVE_AVX 0
+#endif
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define CHIP8_HAVE_JIT 1
+#include <sys/mman.h>
+#else
+#define CHIP8_HAVE_JIT 0
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#define CHIP8_HAVE_AOT 1
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define CHIP8_HAVE_AOT 0
+#endif
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 
@@ -19,12 +56,29 @@
 // Constants
 // ----------------------------------------------------------------------
 constexpr int MEMORY_SIZE     = 4096;
+constexpr int XO_MEMORY_SIZE  = 0x10000;  // XO-CHIP's 16-bit address space
+constexpr int MEGA_MEMORY_SIZE = 0x1000000;  // MegaChip's 24-bit I; code stays in the first 64 KB
 constexpr int START_ADDR      = 0x200;
 constexpr int FONTSET_ADDR    = 0x000;
 constexpr int FONTSET_SIZE    = 80;
+constexpr int BIGFONT_ADDR    = FONTSET_ADDR + FONTSET_SIZE;
+constexpr int BIGFONT_SIZE    = 160;
+constexpr int STACK_SIZE      = 16;     // power of two; sp indexes it masked
+// memory[] carries this many bytes past the end mirroring its first bytes,
+// so an access of up to GUARD_SIZE bytes from a wrapped address stays in
+// the array without wrapping each byte. A 16x16 sprite in both XO-CHIP
+// planes reads 64.
+constexpr int GUARD_SIZE      = 64;
 
 constexpr int DISPLAY_WIDTH   = 64;
 constexpr int DISPLAY_HEIGHT  = 32;
+constexpr int HIRES_WIDTH     = 128;   // SUPER-CHIP high resolution
+constexpr int HIRES_HEIGHT    = 64;
+constexpr int PLANE_COUNT     = 2;     // XO-CHIP bitplanes
+constexpr int AUDIO_PATTERN_SIZE = 16; // XO-CHIP audio pattern, one bit per sample
+constexpr int MEGA_WIDTH      = 256;   // MegaChip, one palette index a pixel
+constexpr int MEGA_HEIGHT     = 192;
+constexpr int MEGA_COLORS     = 256;
 constexpr int WINDOW_WIDTH    = 800;
 constexpr int WINDOW_HEIGHT   = 600;
 constexpr int SCALE_FACTOR    = 8;
@@ -40,7 +94,7 @@ constexpr int BOTTOM_BAR_HEIGHT = 30;
 constexpr int GAME_Y_OFFSET   = TOP_BAR_HEIGHT;
 constexpr int GAME_X_OFFSET   = (WINDOW_WIDTH - GAME_WIDTH) / 2;
 
-static const uint8_t fontset[FONTSET_SIZE] = {
+static constexpr uint8_t fontset[FONTSET_SIZE] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0,
     0x20, 0x60, 0x20, 0x20, 0x70,
     0xF0, 0x10, 0xF0, 0x80, 0xF0,
@@ -59,245 +113,4822 @@ static const uint8_t fontset[FONTSET_SIZE] = {
     0xF0, 0x80, 0xF0, 0x80, 0x80
 };
 
+// SUPER-CHIP 8x10 digits for Fx30; A-F as in Octo.
+static constexpr uint8_t bigfont[BIGFONT_SIZE] = {
+    0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF,
+    0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF,
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF,
+    0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,
+    0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03,
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF,
+    0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18,
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF,
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3,
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC,
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C,
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC,
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0
+};
+
+// ----------------------------------------------------------------------
+// Instruction decoding
+// ----------------------------------------------------------------------
+
+// Operand fields of one instruction, split out once at decode time.
+struct Instr {
+    uint16_t opcode;
+    uint16_t nnn;
+    uint8_t  x;
+    uint8_t  y;
+    uint8_t  n;
+    uint8_t  kk;
+};
+
+constexpr Instr DecodeInstr(uint16_t opcode) {
+    Instr in;
+    in.opcode = opcode;
+    in.nnn    = opcode & 0x0FFF;
+    in.x      = (opcode & 0x0F00) >> 8;
+    in.y      = (opcode & 0x00F0) >> 4;
+    in.n      = opcode & 0x000F;
+    in.kk     = opcode & 0x00FF;
+    return in;
+}
+
+// One id per distinct instruction; unknown encodings map to OP_NOP.
+enum OpId : uint8_t {
+    OP_NOP,
+    OP_00E0, OP_00EE, OP_00CN, OP_00FB, OP_00FC, OP_00FD, OP_00FE, OP_00FF, OP_00DN,
+    OP_001N, OP_00BN, OP_01NN, OP_0XNN,
+    OP_1NNN, OP_2NNN, OP_3XKK, OP_4XKK, OP_5XY0, OP_5XY2, OP_5XY3, OP_6XKK, OP_7XKK,
+    OP_8XY0, OP_8XY1, OP_8XY2, OP_8XY3, OP_8XY4, OP_8XY5, OP_8XY6, OP_8XY7, OP_8XYE,
+    OP_9XY0, OP_ANNN, OP_BNNN, OP_CXKK, OP_DXYN,
+    OP_EX9E, OP_EXA1,
+    OP_FX07, OP_FX0A, OP_FX15, OP_FX18, OP_FX1E, OP_FX29, OP_FX33, OP_FX55, OP_FX65,
+    OP_FX30, OP_FX75, OP_FX85,
+    OP_F000, OP_FN01, OP_F002, OP_FX3A,
+    OP_COUNT
+};
+
+// Extensions a profile lacks classify as they always did: unknown, or for
+// 5xy2/5xy3 the 5xy0 that ignores the low nibble.
+template <class Q>
+constexpr OpId ClassifyOpcode(uint16_t opcode) {
+    switch (opcode >> 12) {
+        case 0x0:
+            if (opcode == 0x00E0) return OP_00E0;
+            if (opcode == 0x00EE) return OP_00EE;
+            if (!Q::superChip) return OP_NOP;
+            if ((opcode & 0xFFF0) == 0x00C0) return OP_00CN;
+            if (Q::xoChip && (opcode & 0xFFF0) == 0x00D0) return OP_00DN;
+            if (Q::megaChip && (opcode & 0xFFFE) == 0x0010) return OP_001N;
+            if (Q::megaChip && (opcode & 0xFFF0) == 0x00B0) return OP_00BN;
+            if (Q::megaChip && (opcode & 0xFF00) == 0x0100) return OP_01NN;
+            if (Q::megaChip && opcode >= 0x0200 && opcode < 0x0A00) return OP_0XNN;
+            if (opcode == 0x00FB) return OP_00FB;
+            if (opcode == 0x00FC) return OP_00FC;
+            if (opcode == 0x00FD) return OP_00FD;
+            if (opcode == 0x00FE) return OP_00FE;
+            if (opcode == 0x00FF) return OP_00FF;
+            return OP_NOP;
+        case 0x1: return OP_1NNN;
+        case 0x2: return OP_2NNN;
+        case 0x3: return OP_3XKK;
+        case 0x4: return OP_4XKK;
+        case 0x5:
+            if (Q::xoChip && (opcode & 0x000F) == 0x2) return OP_5XY2;
+            if (Q::xoChip && (opcode & 0x000F) == 0x3) return OP_5XY3;
+            return OP_5XY0;
+        case 0x6: return OP_6XKK;
+        case 0x7: return OP_7XKK;
+        case 0x8:
+            switch (opcode & 0x000F) {
+                case 0x0: return OP_8XY0;
+                case 0x1: return OP_8XY1;
+                case 0x2: return OP_8XY2;
+                case 0x3: return OP_8XY3;
+                case 0x4: return OP_8XY4;
+                case 0x5: return OP_8XY5;
+                case 0x6: return OP_8XY6;
+                case 0x7: return OP_8XY7;
+                case 0xE: return OP_8XYE;
+                default:  return OP_NOP;
+            }
+        case 0x9: return OP_9XY0;
+        case 0xA: return OP_ANNN;
+        case 0xB: return OP_BNNN;
+        case 0xC: return OP_CXKK;
+        case 0xD: return OP_DXYN;
+        case 0xE:
+            if ((opcode & 0x00FF) == 0x9E) return OP_EX9E;
+            if ((opcode & 0x00FF) == 0xA1) return OP_EXA1;
+            return OP_NOP;
+        case 0xF:
+            if (Q::xoChip && opcode == 0xF000) return OP_F000;
+            if (Q::xoChip && opcode == 0xF002) return OP_F002;
+            if (Q::xoChip && (opcode & 0x00FF) == 0x01) return OP_FN01;
+            if (Q::xoChip && (opcode & 0x00FF) == 0x3A) return OP_FX3A;
+            switch (opcode & 0x00FF) {
+                case 0x07: return OP_FX07;
+                case 0x0A: return OP_FX0A;
+                case 0x15: return OP_FX15;
+                case 0x18: return OP_FX18;
+                case 0x1E: return OP_FX1E;
+                case 0x29: return OP_FX29;
+                case 0x33: return OP_FX33;
+                case 0x55: return OP_FX55;
+                case 0x65: return OP_FX65;
+                case 0x30: return Q::superChip ? OP_FX30 : OP_NOP;
+                case 0x75: return Q::superChip ? OP_FX75 : OP_NOP;
+                case 0x85: return Q::superChip ? OP_FX85 : OP_NOP;
+                default:   return OP_NOP;
+            }
+    }
+    return OP_NOP;
+}
+
+// FNV-1a, used to key on-disk artifacts by ROM contents.
+static constexpr uint64_t HashBytes(const uint8_t* data, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Common instruction sequences the pre-decoded engine runs as one handler.
+enum Fusion : uint8_t {
+    FUSE_NONE,
+    FUSE_ANNN_DXYN,     // ANNN; DXYN            -- point at a sprite and draw it
+    FUSE_ADD_SE_JUMP,   // 7XKK; 3XKK; 1NNN      -- counting loop
+    FUSE_ADD_SNE_JUMP,  // 7XKK; 4XKK; 1NNN
+    FUSE_ADD_JUMP,      // 7XKK; 1NNN
+    FUSE_LOAD3,         // 6XKK; 6XKK; 6XKK
+    FUSE_LOAD2          // 6XKK; 6XKK
+};
+
+// Dispatch strategy used by Chip8::Cycle(). Switch is the reference.
+enum class Engine {
+    Switch,     // 16-way switch plus a second switch for 0/8/E/F groups
+    Table,      // 64K-entry handler table indexed by the full opcode
+    Threaded,   // computed goto (tail-call table where unsupported)
+    Predecoded, // per-address cache of decoded handler plus operands
+    Block,      // cached basic blocks chained to their successors
+    Jit,        // x86-64 native code for hot regions (block engine elsewhere)
+    Aot,        // whole ROM translated to C++ and built with the system compiler
+    Lle         // CDP1802 running the VIP's own interpreter (see LoadVipImages)
+};
+
+static const char* EngineName(Engine engine) {
+    switch (engine) {
+        case Engine::Switch:     return "switch";
+        case Engine::Table:      return "table";
+        case Engine::Threaded:   return "threaded";
+        case Engine::Predecoded: return "predecode";
+        case Engine::Block:      return "block";
+        case Engine::Jit:        return "jit";
+        case Engine::Aot:        return "aot";
+        case Engine::Lle:        return "lle";
+    }
+    return "unknown";
+}
+
+static bool ParseEngine(const std::string& name, Engine& engine) {
+    if (name == "switch")    { engine = Engine::Switch;     return true; }
+    if (name == "table")     { engine = Engine::Table;      return true; }
+    if (name == "threaded")  { engine = Engine::Threaded;   return true; }
+    if (name == "predecode") { engine = Engine::Predecoded; return true; }
+    if (name == "block")     { engine = Engine::Block;      return true; }
+    if (name == "jit")       { engine = Engine::Jit;        return true; }
+    if (name == "aot")       { engine = Engine::Aot;        return true; }
+    if (name == "lle")       { engine = Engine::Lle;        return true; }
+    return false;
+}
+
+// Behaviours that differ between CHIP-8 implementations. A profile is a
+// policy type and the handlers that care are templates on it, so every
+// profile gets its own instantiation with these tests folded away.
+struct LegacyQuirks {
+    static constexpr bool vfReset     = false;  // 8xy1/8xy2/8xy3 clear VF
+    static constexpr bool shiftVx     = false;  // 8xy6/8xyE shift VX in place, not VY into VX
+    static constexpr bool incrementI  = false;  // Fx55/Fx65 leave I past the last register
+    static constexpr bool wrapSprites = false;  // DXYN wraps at the screen edge, not clips
+    static constexpr bool jumpVx      = false;  // BNNN is BXNN: XNN + VX, not NNN + V0
+    static constexpr bool superChip   = false;  // 00Cn 00FB-00FF Dxy0 Fx30 Fx75 Fx85, hires
+    static constexpr bool xoChip      = false;  // 64 KB, F000 NNNN, 5xy2/5xy3, planes, audio
+    static constexpr bool megaChip    = false;  // 16 MB, 24-bit I, 256x192 indexed colour
+};
+
+struct VipQuirks : LegacyQuirks {
+    static constexpr bool vfReset     = true;
+    static constexpr bool incrementI  = true;
+};
+
+struct SchipQuirks : LegacyQuirks {
+    static constexpr bool shiftVx     = true;
+    static constexpr bool jumpVx      = true;
+    static constexpr bool superChip   = true;
+};
+
+struct XoChipQuirks : LegacyQuirks {
+    static constexpr bool incrementI  = true;
+    static constexpr bool wrapSprites = true;
+    static constexpr bool superChip   = true;
+    static constexpr bool xoChip      = true;
+};
+
+struct MegaChipQuirks : SchipQuirks {
+    static constexpr bool megaChip    = true;
+};
+
+// I is 16 bits wide except under MegaChip, where 01NN NNNN loads 24.
+template <class Q>
+constexpr uint32_t INDEX_MASK = Q::megaChip ? 0xFFFFFF : 0xFFFF;
+
+enum class Quirks : uint8_t {
+    Legacy,     // this emulator's historical behaviour
+    Vip,        // COSMAC VIP interpreter
+    Schip,      // SUPER-CHIP 1.1
+    XoChip,     // XO-CHIP
+    MegaChip    // MegaChip 8 (SUPER-CHIP plus the 256x192 mode)
+};
+
+static const char* QuirksName(Quirks quirks) {
+    switch (quirks) {
+        case Quirks::Legacy: return "legacy";
+        case Quirks::Vip:    return "vip";
+        case Quirks::Schip:  return "schip";
+        case Quirks::XoChip: return "xochip";
+        case Quirks::MegaChip: return "megachip";
+    }
+    return "unknown";
+}
+
+static bool ParseQuirks(const std::string& name, Quirks& quirks) {
+    if (name == "legacy") { quirks = Quirks::Legacy; return true; }
+    if (name == "vip")    { quirks = Quirks::Vip;    return true; }
+    if (name == "schip")  { quirks = Quirks::Schip;  return true; }
+    if (name == "xochip") { quirks = Quirks::XoChip; return true; }
+    if (name == "megachip") { quirks = Quirks::MegaChip; return true; }
+    return false;
+}
+
+// Calls f with a value of the policy type for quirks. Engines call this
+// once per batch, never per instruction.
+template <class F>
+static constexpr auto WithQuirks(Quirks quirks, F&& f) -> decltype(f(LegacyQuirks())) {
+    switch (quirks) {
+        case Quirks::Vip:    return f(VipQuirks());
+        case Quirks::Schip:  return f(SchipQuirks());
+        case Quirks::XoChip: return f(XoChipQuirks());
+        case Quirks::MegaChip: return f(MegaChipQuirks());
+        default:             return f(LegacyQuirks());
+    }
+}
+
+// The same switches as plain values, for the code generators.
+struct QuirkFlags {
+    bool vfReset;
+    bool shiftVx;
+    bool incrementI;
+    bool wrapSprites;
+    bool jumpVx;
+    bool superChip;
+    bool xoChip;
+    bool megaChip;
+};
+
+static constexpr QuirkFlags FlagsOf(Quirks quirks) {
+    return WithQuirks(quirks, [](auto q) {
+        using Q = decltype(q);
+        return QuirkFlags{Q::vfReset, Q::shiftVx, Q::incrementI, Q::wrapSprites, Q::jumpVx,
+                          Q::superChip, Q::xoChip, Q::megaChip};
+    });
+}
+
+// How RunFrame() measures guest time. Each model gives every instruction
+// a cost and every frame a budget, so the speed a ROM runs at follows its
+// instruction mix rather than the host.
+enum class Timing : uint8_t {
+    Flat,       // every instruction costs 1; the budget is a rate in instructions/second
+    Vip         // COSMAC VIP interpreter, costs in 1802 machine cycles
+};
+
+static const char* TimingName(Timing timing) {
+    switch (timing) {
+        case Timing::Flat: return "flat";
+        case Timing::Vip:  return "vip";
+    }
+    return "unknown";
+}
+
+static bool ParseTiming(const std::string& name, Timing& timing) {
+    if (name == "flat") { timing = Timing::Flat; return true; }
+    if (name == "vip")  { timing = Timing::Vip;  return true; }
+    return false;
+}
+
+// The VIP's 1802 runs at 1.76 MHz, 8 clocks per machine cycle: 3668
+// machine cycles per 60 Hz frame, of which the 1861's display DMA takes
+// 1024 (8 bytes on each of 128 scanlines). Instruction costs are
+// approximate figures for the VIP interpreter: a shared fetch/decode plus
+// a per-opcode part, with the data-dependent terms added in VipCost().
+constexpr int32_t VIP_CYCLES_PER_FRAME = 3668;
+constexpr int32_t VIP_DMA_CYCLES       = 1024;
+constexpr int32_t VIP_FRAME_CYCLES     = VIP_CYCLES_PER_FRAME - VIP_DMA_CYCLES;
+constexpr int32_t VIP_FETCH_CYCLES     = 40;
+constexpr int32_t VIP_SKIP_CYCLES      = 4;     // taken skip
+
+static const uint16_t VIP_OP_CYCLES[OP_COUNT] = {
+    20,                         // 0NNN machine-code call, not emulated
+    1560, 10,                   // 00E0 clears 256 bytes; 00EE
+    1560, 1560, 1560, 10, 1560, 1560, 1560,  // 00CN 00FB 00FC 00FD 00FE 00FF 00DN, not on the VIP
+    1560, 1560, 20, 10,         // 001N 00BN 01NN 0XNN, nor these
+    12, 26, 10, 10, 14, 14, 14, 6, 10,  // 1NNN 2NNN 3XKK 4XKK 5XY0 5XY2 5XY3 6XKK 7XKK
+    44, 44, 44, 44, 44, 44, 44, 44, 44,  // 8XY_, run from a RAM trampoline
+    14, 12, 22, 36, 26,         // 9XY0 ANNN BNNN CXKK DXYN (+ rows)
+    14, 14,                     // EX9E EXA1
+    10, 20, 10, 10, 16, 16, 84, 14, 14,  // FX07 FX0A FX15 FX18 FX1E FX29 FX33 FX55 FX65
+    16, 14, 14,                 // FX30 FX75 FX85, not on the VIP
+    20, 10, 14, 10              // F000 FN01 F002 FX3A, nor these
+};
+
+static bool IsSkip(uint8_t id) {
+    switch (id) {
+        case OP_3XKK: case OP_4XKK: case OP_5XY0: case OP_9XY0:
+        case OP_EX9E: case OP_EXA1:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// ----------------------------------------------------------------------
+// Intermediate representation
+// ----------------------------------------------------------------------
+// The block, JIT and AOT engines translate straight-line guest code into
+// a list of IrOps and optimise that before emitting anything. An op stays
+// a real instruction: a pass either flags it or rewrites it into another
+// opcode with the same effect, so the list still runs through the
+// interpreter (Chip8::RunIr) and each pass can be checked against it.
+enum IrFlag : uint8_t {
+    IR_DEAD    = 1 << 0,  // nothing reads the result; counted but not run
+    IR_NO_VF   = 1 << 1,  // 8xy1..8xyE whose VF result nothing reads
+    IR_HOISTED = 1 << 2,  // ANNN set once before a loop instead of every pass
+};
+
+struct IrOp {
+    uint16_t addr;
+    uint8_t  id;
+    uint8_t  flags;
+    Instr    in;
+};
+
+// Register masks: V0..VF are bits 0-15, I is bit 16.
+constexpr uint32_t IR_I   = 1 << 16;
+constexpr uint32_t IR_VF  = 1 << 0xF;
+constexpr uint32_t IR_ALL = 0x1FFFF;
+
+struct IrEffect {
+    uint32_t reads;
+    uint32_t writes;
+};
+
+// What the passes model. A skip can leave the list, so everything is
+// read there; any other op they do not know reads and writes the lot.
+static constexpr IrEffect IrEffectOf(const IrOp& op, const QuirkFlags& quirks) {
+    const Instr& in = op.in;
+    uint32_t x = 1u << in.x;
+    uint32_t y = 1u << in.y;
+    uint32_t vf = op.flags & IR_NO_VF ? 0 : IR_VF;
+    switch (op.id) {
+        case OP_NOP: case OP_1NNN: return {0, 0};
+        case OP_3XKK: case OP_4XKK: case OP_5XY0: case OP_9XY0:
+        case OP_EX9E: case OP_EXA1:
+            return {IR_ALL, 0};
+        case OP_6XKK: case OP_FX07: case OP_CXKK: return {0, x};
+        case OP_7XKK: return {x, x};
+        case OP_8XY0: return {y, x};
+        case OP_8XY1: case OP_8XY2: case OP_8XY3: return {x | y, x | (quirks.vfReset ? vf : 0)};
+        case OP_8XY4: case OP_8XY5: case OP_8XY7: return {x | y, x | vf};
+        case OP_8XY6: case OP_8XYE: return {quirks.shiftVx ? x : y, x | vf};
+        case OP_ANNN: return {0, IR_I};
+        case OP_FX1E: return {x | IR_I, IR_I};
+        case OP_FX29: return {x, IR_I};
+        case OP_FX15: case OP_FX18: return {x, 0};
+        default: return {IR_ALL, IR_ALL};
+    }
+}
+
+// The 8xy ops that set VF as a side result. With VF as an operand the
+// order of the two writes matters, so those are left alone.
+static constexpr bool IrSetsFlag(const IrOp& op, const QuirkFlags& quirks) {
+    if (op.in.x == 0xF || op.in.y == 0xF) return false;
+    switch (op.id) {
+        case OP_8XY1: case OP_8XY2: case OP_8XY3: return quirks.vfReset;
+        case OP_8XY4: case OP_8XY5: case OP_8XY6: case OP_8XY7: case OP_8XYE: return true;
+        default: return false;
+    }
+}
+
+// Tracks registers holding known constants. 7XKK, 8XY0 and 8xy ops whose
+// inputs are known become 6XKK (one that sets VF only once the VF result
+// is dead), FX1E and FX29 become ANNN when the new I fits, and a load of
+// the value already there is dead.
+static constexpr void IrPropagateConstants(std::vector<IrOp>& ops, const QuirkFlags& quirks) {
+    uint32_t known = 0;
+    uint8_t value[16] = {};
+    uint32_t index = 0;
+    for (IrOp& op : ops) {
+        if (op.flags & IR_DEAD) continue;
+        const Instr& in = op.in;
+        auto isKnown = [&](int r) { return (known >> r & 1) != 0; };
+        uint8_t vx = value[in.x];
+        uint8_t vy = value[in.y];
+        uint8_t src = quirks.shiftVx ? vx : vy;
+        bool operands = in.x != 0xF && in.y != 0xF && isKnown(in.x) && isKnown(in.y);
+        bool shifted = in.x != 0xF && in.y != 0xF && isKnown(quirks.shiftVx ? in.x : in.y);
+
+        if ((op.id == OP_6XKK && isKnown(in.x) && vx == in.kk) ||
+            (op.id == OP_ANNN && (known & IR_I) && index == in.nnn)) {
+            op.flags |= IR_DEAD;
+            continue;
+        }
+
+        int result = -1;
+        int flag = 0;  // 8xy1..8xy3 clear VF under vfReset
+        switch (op.id) {
+            case OP_6XKK: result = in.kk; break;
+            case OP_7XKK: if (isKnown(in.x)) result = (vx + in.kk) & 0xFF; break;
+            case OP_8XY0: if (isKnown(in.y)) result = vy; break;
+            case OP_8XY1: if (operands) result = vx | vy; break;
+            case OP_8XY2: if (operands) result = vx & vy; break;
+            case OP_8XY3: if (operands) result = vx ^ vy; break;
+            case OP_8XY4: if (operands) result = (vx + vy) & 0xFF, flag = vx + vy > 0xFF; break;
+            case OP_8XY5: if (operands) result = (vx - vy) & 0xFF, flag = vx > vy; break;
+            case OP_8XY7: if (operands) result = (vy - vx) & 0xFF, flag = vy > vx; break;
+            case OP_8XY6: if (shifted) result = src >> 1, flag = src & 1; break;
+            case OP_8XYE: if (shifted) result = (src << 1) & 0xFF, flag = src >> 7; break;
+            default: break;
+        }
+
+        bool indexed = false;
+        uint32_t next = 0;
+        switch (op.id) {
+            case OP_ANNN: indexed = true; next = in.nnn; break;
+            case OP_FX1E:
+                indexed = (known & IR_I) && isKnown(in.x);
+                next = (index + vx) & (quirks.megaChip ? 0xFFFFFF : 0xFFFF);
+                break;
+            case OP_FX29: indexed = isKnown(in.x); next = FONTSET_ADDR + vx * 5; break;
+            default: break;
+        }
+
+        bool sideFlag = IrSetsFlag(op, quirks) && !(op.flags & IR_NO_VF);
+        known &= ~IrEffectOf(op, quirks).writes;
+        if (result >= 0) {
+            value[in.x] = static_cast<uint8_t>(result);
+            known |= 1u << in.x;
+            if (sideFlag) {
+                value[0xF] = static_cast<uint8_t>(flag);
+                known |= IR_VF;
+            } else if (op.id != OP_6XKK) {
+                op.id = OP_6XKK;
+                op.in = DecodeInstr(static_cast<uint16_t>(0x6000 | in.x << 8 | result));
+                op.flags &= ~IR_NO_VF;
+            }
+        }
+        if (indexed) {
+            index = next;
+            known |= IR_I;
+            if (op.id != OP_ANNN && next <= 0xFFF) {
+                op.id = OP_ANNN;
+                op.in = DecodeInstr(static_cast<uint16_t>(0xA000 | next));
+            }
+        }
+    }
+}
+
+// Backward liveness over the list, with everything live after it. A
+// load nothing reads is dead, and so is the VF result of an 8xy op.
+static constexpr void IrRemoveDeadStores(std::vector<IrOp>& ops, const QuirkFlags& quirks) {
+    uint32_t live = IR_ALL;
+    for (size_t i = ops.size(); i-- > 0;) {
+        IrOp& op = ops[i];
+        if (op.flags & IR_DEAD) continue;
+        switch (op.id) {
+            case OP_6XKK: case OP_7XKK: case OP_8XY0: case OP_8XY1: case OP_8XY2: case OP_8XY3:
+            case OP_8XY4: case OP_8XY5: case OP_8XY6: case OP_8XY7: case OP_8XYE:
+            case OP_ANNN: case OP_FX1E: case OP_FX29: case OP_FX07:
+                if (!(IrEffectOf(op, quirks).writes & live)) {
+                    op.flags |= IR_DEAD;
+                    continue;
+                }
+                break;
+            default: break;
+        }
+        if (IrSetsFlag(op, quirks) && !(live & IR_VF)) op.flags |= IR_NO_VF;
+        IrEffect effect = IrEffectOf(op, quirks);
+        live = (live & ~effect.writes) | effect.reads;
+    }
+}
+
+// For a list the JIT runs as a loop. An ANNN that is the only write to I,
+// with no read of I and no exit before it, sets the same I every pass,
+// so it can be done once on entry.
+static constexpr void IrHoistIndex(std::vector<IrOp>& ops, const QuirkFlags& quirks) {
+    IrOp* load = nullptr;
+    bool touched = false;
+    for (IrOp& op : ops) {
+        if (op.flags & IR_DEAD) continue;
+        IrEffect effect = IrEffectOf(op, quirks);
+        if (op.id == OP_ANNN && !load && !touched) {
+            load = &op;
+        } else if (effect.writes & IR_I) {
+            return;
+        } else if (effect.reads & IR_I) {
+            touched = true;
+        }
+    }
+    if (load) load->flags |= IR_HOISTED;
+}
+
+// A folded 8xy op can leave the loads it read dead, so the first two
+// passes run twice.
+static constexpr void OptimizeIr(std::vector<IrOp>& ops, const QuirkFlags& quirks, bool loops) {
+    IrPropagateConstants(ops, quirks);
+    IrRemoveDeadStores(ops, quirks);
+    IrPropagateConstants(ops, quirks);
+    IrRemoveDeadStores(ops, quirks);
+    if (loops) IrHoistIndex(ops, quirks);
+}
+
+// Control transfers, draws and stores: the last op of a list.
+static constexpr bool EndsBlock(uint8_t id) {
+    switch (id) {
+        case OP_00EE: case OP_1NNN: case OP_2NNN: case OP_BNNN:
+        case OP_3XKK: case OP_4XKK: case OP_5XY0: case OP_9XY0:
+        case OP_EX9E: case OP_EXA1:
+        case OP_00E0: case OP_DXYN: case OP_FX0A: case OP_FX18:
+        case OP_FX33: case OP_FX55:
+        case OP_00CN: case OP_00FB: case OP_00FC: case OP_00FD: case OP_00FE: case OP_00FF:
+        case OP_00DN: case OP_5XY2: case OP_F000:
+        case OP_001N: case OP_00BN: case OP_01NN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Owning pointer for the engine caches. Chip8 has to be destructible in
+// constant evaluation (see the compile-time checks) and unique_ptr's
+// destructor is not constexpr before C++23; the caches themselves are
+// only ever created at run time.
+template <class T>
+class CachePtr {
+public:
+    constexpr CachePtr() : p(nullptr) {}
+    CachePtr(const CachePtr&) = delete;
+    CachePtr& operator=(const CachePtr&) = delete;
+    constexpr ~CachePtr() { reset(); }
+
+    constexpr void reset(T* next = nullptr) {
+        if (p) delete p;
+        p = next;
+    }
+    constexpr T* operator->() const { return p; }
+    constexpr T& operator*() const { return *p; }
+    constexpr explicit operator bool() const { return p != nullptr; }
+
+private:
+    T* p;
+};
+
+// ----------------------------------------------------------------------
+// Chip8 class
+// ----------------------------------------------------------------------
+class Chip8 {
+public:
+    // Events that end a RunCycles()/RunFrame() batch early, as a mask.
+    enum StopEvent : uint8_t {
+        STOP_DRAW       = 1 << 0,  // 00E0, DXYN or a scroll or mode change touched the display
+        STOP_SOUND      = 1 << 1,  // FX18 turned the beeper on or off
+        STOP_KEY_WAIT   = 1 << 2,  // FX0A halted, or is still halted, waiting for a key
+        STOP_BREAKPOINT = 1 << 3,  // about to execute a breakpoint address
+        STOP_ALL        = 0x0F
+    };
+    enum class StopReason : uint8_t { Budget, Draw, Sound, KeyWait, Breakpoint };
+    struct RunResult {
+        uint32_t   executed;  // instructions actually run
+        uint32_t   elided;    // idle-loop cycles skipped (see IdlePeriod)
+        StopReason reason;    // Budget: the whole batch was consumed
+    };
+    // Cxkk's generator (xoshiro128**), part of the machine state.
+    struct RngState {
+        uint32_t s[4];
+    };
+
+    constexpr Chip8();
+    void LoadROM(const std::string& filename);
+    constexpr bool LoadROM(const uint8_t* data, size_t size);
+    constexpr void Cycle();
+    RunResult RunCycles(uint32_t count, uint8_t stopOn = STOP_ALL);
+    RunResult RunFrame(uint8_t stopOn = STOP_ALL);
+    void SetTiming(Timing t, uint32_t flatHz = CPU_HZ);
+    Timing GetTiming() const { return timing; }
+    uint64_t GetCycleCount() const { return cycleCount; }
+    void SetBreakpoint(uint16_t addr, bool enabled);
+    bool NeedsRedraw() const { return drawFlag; }
+    void ClearDrawFlag() { drawFlag = false; }
+    // Lores row y of plane p, pixel 0 in the top bit.
+    constexpr uint64_t GetLoresRow(int y, int p = 0) const {
+        return display[p & (PLANE_COUNT - 1)][y & (DISPLAY_HEIGHT - 1)];
+    }
+    // Plane 0 as one byte per pixel, DISPLAY_WIDTH x DISPLAY_HEIGHT.
+    constexpr void ExpandDisplay(uint8_t* out) const {
+        for (int i = 0; i < DISPLAY_WIDTH * DISPLAY_HEIGHT; ++i)
+            out[i] = display[0][i / DISPLAY_WIDTH] >> (DISPLAY_WIDTH - 1 - i % DISPLAY_WIDTH) & 1;
+    }
+    // SUPER-CHIP 128x64 mode, shown instead of the lores rows while on. Row
+    // y is two words, pixel 0 in the top bit of the first.
+    constexpr bool IsHires() const { return hires; }
+    constexpr const uint64_t* GetHiresRow(int y, int p = 0) const {
+        return &plane[p & (PLANE_COUNT - 1)][(y & (HIRES_HEIGHT - 1)) * 2];
+    }
+    // Both planes as one colour index per pixel (bit p from plane p), for
+    // the current mode: DISPLAY_ or HIRES_WIDTH x HEIGHT bytes.
+    void Compose(uint8_t* out) const;
+    // XO-CHIP sound: a 128-bit pattern played at GetPatternRate() bits per
+    // second while the sound timer runs.
+    constexpr const uint8_t* GetAudioPattern() const { return audio; }
+    double GetPatternRate() const { return 4000.0 * std::exp2((pitch - 64) / 48.0); }
+    // MegaChip 256x192 mode, shown instead of the others while on: one
+    // palette index a pixel, row-major, and MEGA_COLORS ARGB entries.
+    constexpr bool IsMegaChip() const { return megaOn; }
+    const uint8_t* GetMegaScreen() const;
+    const uint32_t* GetMegaPalette() const;
+    constexpr uint8_t GetV(int x) const { return V[x & 0xF]; }
+    constexpr uint32_t GetI() const { return I; }
+    constexpr uint16_t GetPC() const { return pc; }
+    constexpr uint8_t Peek(uint32_t addr) const { return memory[addr & (memSize - 1)]; }
+    // Guest accesses that fell outside memory, the stack or the keypad and
+    // were wrapped back into range.
+    constexpr uint64_t GetFaultCount() const { return faults; }
+    // The seed survives Reset(), which restarts the generator from it.
+    constexpr void SeedRandom(uint64_t seed);
+    constexpr RngState GetRngState() const { return rng; }
+    constexpr void SetRngState(const RngState& state) { rng = state; }
+    constexpr void SetKey(int key, bool pressed);
+    constexpr bool IsHalted() const { return halted; }
+    constexpr bool GetSoundState() const { return SoundTimer() > 0; }
+    void SetEngine(Engine e) { engine = e; }
+    // ROM images the LLE engine boots: the 512-byte VIP monitor and the
+    // CHIP-8 interpreter it runs from address 0. Shared by every instance.
+    static bool LoadVipImages(const std::string& monitor, const std::string& interpreter);
+    Engine GetEngine() const { return engine; }
+    void SetFusion(bool enabled) { fusionEnabled = enabled; }
+    void SetIdleSkip(bool enabled) { idleSkip = enabled; }
+    void SetLazyFlags(bool enabled);
+    constexpr void SetQuirks(Quirks q);
+    Quirks GetQuirks() const { return quirks; }
+    bool IsIdle() const { bool settling; return halted || IdlePeriod(settling) != 0; }
+    uint64_t GetIdleCycles() const { return idleCycles; }
+    bool SameState(const Chip8& other) const;
+    constexpr void Reset();
+    // Straight-line code from addr as the fast engines see it, and a list
+    // run back through the interpreter, so each IR pass can be checked on
+    // its own. leaders, if given, marks addresses the list must stop short of.
+    constexpr std::vector<IrOp> TranslateIr(uint16_t addr, const uint8_t* leaders = nullptr) const;
+    constexpr void RunIr(const std::vector<IrOp>& ops);
+
+private:
+    using OpFn = void (*)(Chip8&, const Instr&);
+
+    // Raised in stopHit by Fx0A whatever stopOn says, so the engines leave
+    // the batch and the run loop sees the halt.
+    static constexpr uint8_t STOP_HALT = 1 << 7;
+
+    // Shared by every instance; built once at static initialisation.
+    struct OpTables {
+        OpFn    handler[0x10000];
+        uint8_t id[0x10000];
+    };
+    // tables is the legacy profile, used until SetQuirks() picks another.
+    static const OpTables& tables;
+    template <class Q> static const OpTables& BuildTables();
+    template <class Q> static const OpTables& TablesFor();
+
+    // Shadow of memory[]: entry a holds the instruction starting at a.
+    // fn == nullptr means not decoded yet (or invalidated by a store).
+    // A fused entry also covers the fusedLen - 1 entries that follow it.
+    struct DecodedOp {
+        OpFn    fn;
+        Instr   in;
+        uint8_t fusion;
+        uint8_t fusedLen;
+    };
+
+    struct Block;
+    struct BlockCache;
+    struct JitRegion;
+    struct JitCache;
+    struct AotModule;
+    struct Cosmac;
+    struct MegaState;
+
+    // memSize bytes of guest memory, then GUARD_SIZE mirroring the first.
+    // That is ram[] except under MegaChip, whose 16 MB live in mega.
+    uint8_t  ram[XO_MEMORY_SIZE + GUARD_SIZE];
+    uint8_t* memory;
+    uint32_t memSize;       // MEMORY_SIZE, XO_MEMORY_SIZE or MEGA_MEMORY_SIZE
+    uint8_t  V[16];
+    uint32_t I;             // within INDEX_MASK of the profile
+    uint16_t pc;
+    uint8_t  sp;            // depth; stack[] is indexed by sp & (STACK_SIZE - 1)
+    uint16_t stack[STACK_SIZE];
+    uint8_t  delay_timer;   // as of timerTicks; see SyncTimers()
+    uint8_t  sound_timer;
+    uint8_t  keypad[16];
+    uint64_t display[PLANE_COUNT][DISPLAY_HEIGHT];  // lores rows, one word each
+    alignas(16) uint64_t plane[PLANE_COUNT][HIRES_HEIGHT * 2];  // hires rows, two words each
+    bool     hires;
+    uint8_t  planeMask;     // planes Dxyn, 00E0 and the scrolls act on
+    uint8_t  audio[AUDIO_PATTERN_SIZE];
+    uint8_t  pitch;
+    uint8_t  rpl[16];       // Fx75/Fx85 flag registers
+    bool     megaOn;        // 0011 until 0010
+    uint16_t spriteWidth;   // 03NN and 04NN, 1 to 256
+    uint16_t spriteHeight;
+    uint8_t  collisionColor;  // 09NN
+    bool     drawFlag;
+    Engine   engine;
+    Quirks   quirks;
+    const OpFn* handlers;   // handler table for quirks
+    const uint8_t* ids;     // OpId of every opcode under quirks
+    bool     fusionEnabled;
+    bool     idleSkip;
+    uint64_t idleCycles;
+    uint64_t faults;
+    uint64_t rngSeed;
+    RngState rng;
+    bool     lazyFlags;
+    uint32_t pendingFlag;   // FlagKind << 16 | a << 8 | b, or 0 if VF is current
+    uint8_t  stopOn;        // StopEvent mask for the batch in progress
+    uint8_t  stopHit;       // events raised so far in this batch
+    bool     halted;        // in Fx0A until a key is pressed and released
+    uint8_t  haltReg;       // the Fx0A's X
+    int8_t   haltKey;       // key pressed while halted, or -1
+    Timing   timing;
+    uint32_t flatHz;        // instructions per second under Timing::Flat
+    uint64_t cycleCount;    // guest time, in the timing model's cost units
+    uint64_t timingEpoch;   // cycleCount when the timing model was set
+    uint64_t timerTicks;    // ticks since timingEpoch applied to the timer fields
+    std::vector<uint8_t> breakpoints;  // empty, or one flag per address
+    std::vector<DecodedOp> decoded;  // memSize entries once an engine uses it
+    CachePtr<BlockCache> blockCache;
+    CachePtr<JitCache> jit;
+    CachePtr<AotModule> aot;
+    CachePtr<Cosmac> lle;
+    CachePtr<MegaState> mega;
+    uint32_t romSize;
+    uint64_t romHash;
+
+    // Guest addresses wrap at the end of memory; the guard band covers the
+    // second byte.
+    constexpr uint16_t ReadOpcode(uint16_t addr) const {
+        const uint8_t* p = &memory[addr & (memSize - 1)];
+        return (p[0] << 8) | p[1];
+    }
+
+    // First byte of an access of len bytes at I, wrapped. Counts a fault if
+    // the access would have run off the end of memory.
+    constexpr uint8_t* GuestSpan(uint32_t len) {
+        faults += I + len > memSize;
+        return &memory[I & (memSize - 1)];
+    }
+
+    // pc is 16 bits, so code only ever runs from the first 64 KB.
+    constexpr uint32_t CodeSize() const { return std::min<uint32_t>(memSize, XO_MEMORY_SIZE); }
+
+    constexpr uint16_t Fetch() {
+        pc &= memSize - 1;
+        uint16_t opcode = ReadOpcode(pc);
+        pc += 2;
+        return opcode;
+    }
+
+    uint32_t Run(uint32_t count);
+    RunResult RunDebug(uint32_t count);
+    RunResult RunCosted(uint32_t count, uint64_t until);
+    void Step();
+    constexpr uint64_t TicksAt(uint64_t t) const;
+    uint64_t NextTickAt() const;
+    constexpr void SyncTimers();
+    constexpr uint8_t DelayTimer() const;
+    constexpr uint8_t SoundTimer() const;
+    int32_t VipCost(const Instr& in) const;
+    OpFn HandlerFor(uint16_t opcode) const;
+    constexpr void SyncFlags() { if (pendingFlag) MaterializeFlag(); }
+    constexpr void MaterializeFlag();
+    static void SyncedOp(Chip8& chip8, const Instr& in);
+    uint32_t IdlePeriod(bool& settling) const;
+    // Bytes a taken skip at addr moves past: 4, or 6 over an XO-CHIP F000 NNNN.
+    constexpr uint16_t SkipLength(uint16_t addr) const {
+        return FlagsOf(quirks).xoChip && ReadOpcode(addr + 2) == 0xF000 ? 6 : 4;
+    }
+
+    template <class Q> constexpr void StepSwitch();
+    template <class Q> constexpr void ExecuteSwitch(const Instr& in);
+    constexpr uint8_t IdOf(uint16_t opcode) const;
+    OpFn IrHandler(const IrOp& op) const;
+    template <class Q> uint32_t RunSwitch(uint32_t count);
+    void StepTable();
+    template <class Q> uint32_t RunThreaded(uint32_t count);
+    void StepPredecoded();
+    uint32_t RunPredecoded(uint32_t count);
+    void DecodeAt(uint16_t addr);
+    uint32_t RunFused(const DecodedOp* op);
+    constexpr void InvalidateDecoded(uint32_t addr, uint32_t len);
+    constexpr void CommitStore(uint32_t addr, uint32_t len);
+    constexpr bool KeyDown(uint8_t key);
+    constexpr uint32_t NextRandom();
+    uint32_t RunBlocks(uint32_t count);
+    Block* LookupBlock(uint16_t addr);
+    Block* TranslateBlock(uint16_t addr);
+    uint32_t RunJit(uint32_t count);
+    const JitRegion& CompileRegion(uint16_t addr);
+    void OpenJitCache();
+    const JitRegion* RestoreRegion(uint16_t addr);
+    uint32_t RunAot(uint32_t count);
+    void LoadAot();
+    std::vector<std::vector<IrOp>> AotBlocks(const std::vector<uint8_t>& reachable) const;
+    std::string GenerateAotSource(const std::vector<std::vector<IrOp>>& blocks) const;
+    static void AotExec(void* machine, uint16_t opcode);
+    RunResult RunLle(uint32_t count, bool toFrameEnd, uint8_t events);
+    bool BootLle();
+
+    // Second-level dispatch for the reference switch engine
+    template <class Q> constexpr void Opcode0xxx(const Instr& in);
+    template <class Q> constexpr void Opcode5xxx(const Instr& in);
+    template <class Q> constexpr void Opcode8xxx(const Instr& in);
+    template <class Q> constexpr void OpcodeExxx(const Instr& in);
+    template <class Q> constexpr void OpcodeFxxx(const Instr& in);
+
+    // One handler per instruction, shared by all engines
+    constexpr void OpNop(const Instr&) {}
+    constexpr void Op00E0(const Instr& in);
+    constexpr void Op00EE(const Instr& in);
+    template <class Q> constexpr void Op00Cn(const Instr& in);
+    template <class Q> constexpr void Op00FB(const Instr& in);
+    template <class Q> constexpr void Op00FC(const Instr& in);
+    template <class Q> constexpr void Op00FD(const Instr& in);
+    template <class Q> constexpr void Op00FE(const Instr& in);
+    template <class Q> constexpr void Op00FF(const Instr& in);
+    template <class Q> constexpr void Op00Dn(const Instr& in);
+    template <class Q> constexpr void Op001N(const Instr& in);
+    template <class Q> constexpr void Op00Bn(const Instr& in);
+    template <class Q> constexpr void Op01nn(const Instr& in);
+    template <class Q> constexpr void Op0xnn(const Instr& in);
+    constexpr void Op1nnn(const Instr& in);
+    constexpr void Op2nnn(const Instr& in);
+    template <class Q> constexpr void Skip();
+    template <class Q> constexpr void Op3xkk(const Instr& in);
+    template <class Q> constexpr void Op4xkk(const Instr& in);
+    template <class Q> constexpr void Op5xy0(const Instr& in);
+    template <class Q> constexpr void Op5xy2(const Instr& in);
+    template <class Q> constexpr void Op5xy3(const Instr& in);
+    constexpr void Op6xkk(const Instr& in);
+    constexpr void Op7xkk(const Instr& in);
+    constexpr void Op8xy0(const Instr& in);
+    template <class Q> constexpr void Op8xy1(const Instr& in);
+    template <class Q> constexpr void Op8xy2(const Instr& in);
+    template <class Q> constexpr void Op8xy3(const Instr& in);
+    constexpr void Op8xy4(const Instr& in);
+    constexpr void Op8xy5(const Instr& in);
+    template <class Q> constexpr void Op8xy6(const Instr& in);
+    constexpr void Op8xy7(const Instr& in);
+    template <class Q> constexpr void Op8xyE(const Instr& in);
+    constexpr void Op8xy4Lazy(const Instr& in);
+    constexpr void Op8xy5Lazy(const Instr& in);
+    template <class Q> constexpr void Op8xy6Lazy(const Instr& in);
+    constexpr void Op8xy7Lazy(const Instr& in);
+    template <class Q> constexpr void Op8xyELazy(const Instr& in);
+    template <uint8_t Id, class Q> constexpr void Op8xyNoVF(const Instr& in);
+    template <class Q> constexpr void Op9xy0(const Instr& in);
+    constexpr void OpAnnn(const Instr& in);
+    template <class Q> constexpr void OpBnnn(const Instr& in);
+    constexpr void OpCxkk(const Instr& in);
+    template <class Q> constexpr void OpDxyn(const Instr& in);
+    template <class Q> constexpr bool DrawLores(uint64_t* rows, const uint8_t* sprite, int x, int y,
+                                                int count, bool wide);
+    template <class Q> constexpr bool DrawHires(uint64_t* rows, const uint8_t* sprite, int x, int y,
+                                                int count, bool wide);
+    bool DrawMega(int x, int y);
+    void ScrollMega(int dx, int dy);
+    constexpr void ClearPlanes(uint8_t mask);
+    constexpr void ScrollPlanes(int dx, int dy);
+    constexpr void SetHires(bool on);
+    template <class Q> constexpr void OpEx9E(const Instr& in);
+    template <class Q> constexpr void OpExA1(const Instr& in);
+    constexpr void OpFx07(const Instr& in);
+    constexpr void OpFx0A(const Instr& in);
+    constexpr void OpFx15(const Instr& in);
+    constexpr void OpFx18(const Instr& in);
+    template <class Q> constexpr void OpFx1E(const Instr& in);
+    constexpr void OpFx29(const Instr& in);
+    constexpr void OpFx33(const Instr& in);
+    template <class Q> constexpr void OpFx55(const Instr& in);
+    template <class Q> constexpr void OpFx65(const Instr& in);
+    template <class Q> constexpr void OpFx30(const Instr& in);
+    template <class Q> constexpr void OpFx75(const Instr& in);
+    template <class Q> constexpr void OpFx85(const Instr& in);
+    template <class Q> constexpr void OpF000(const Instr& in);
+    template <class Q> constexpr void OpFn01(const Instr& in);
+    template <class Q> constexpr void OpF002(const Instr& in);
+    template <class Q> constexpr void OpFx3A(const Instr& in);
+
+    template <void (Chip8::*Handler)(const Instr&)>
+    static void Thunk(Chip8& chip8, const Instr& in) { (chip8.*Handler)(in); }
+};
+
+constexpr int      MAX_BLOCK_OPS = 64;
+constexpr uint16_t NO_SUCCESSOR  = 0xFFFF;
+
+// Straight-line run of micro-ops ending at a control transfer, a draw or
+// a store. Successors are linked lazily the first time each is taken.
+struct Chip8::Block {
+    uint16_t start;
+    uint16_t end;              // one past the last guest byte covered
+    uint16_t length;           // guest instructions covered, dead ones included
+    std::vector<DecodedOp> ops;
+    uint16_t succPc[2];
+    Block*   succ[2];
+};
+
+// Guest bytes read by translated code. A store that hits one marks the
+// owning cache dirty; it is flushed before the next lookup.
+struct CodeMap {
+    uint8_t covered[XO_MEMORY_SIZE];
+    bool    dirty;
+
+    CodeMap() { Clear(); }
+
+    void Clear() {
+        std::memset(covered, 0, sizeof(covered));
+        dirty = false;
+    }
+
+    void MarkInstr(uint16_t addr) { covered[addr] = covered[(addr + 1) & (XO_MEMORY_SIZE - 1)] = 1; }
+
+    void Invalidate(uint32_t addr, uint32_t len) {
+        for (uint32_t a = addr; a < static_cast<uint32_t>(addr) + len && a < XO_MEMORY_SIZE; ++a) {
+            if (covered[a]) {
+                dirty = true;
+                return;
+            }
+        }
+    }
+};
+
+struct Chip8::BlockCache {
+    std::unordered_map<uint16_t, std::unique_ptr<Block>> blocks;
+    CodeMap code;
+
+    // Blocks are chained by raw pointer, so they are dropped all at once.
+    void Flush() {
+        blocks.clear();
+        code.Clear();
+    }
+};
+
+constexpr size_t JIT_CODE_SIZE    = 4 << 20;
+constexpr size_t JIT_REGION_SLACK = 64 << 10;  // flush when less than this is free
+
+// Native code for one region. fn runs at most maxPath guest instructions
+// per pass and returns the unused part of the budget; nullptr means the
+// first instruction is not compiled and must be interpreted.
+struct Chip8::JitRegion {
+    uint32_t (*fn)(Chip8* self, uint32_t budget);
+    uint32_t maxPath;
+};
+
+// Emitted code only refers to the machine through rdi and to itself
+// through relative jumps, so regions can be saved and copied back into a
+// later process. Bump JIT_VERSION whenever CompileRegion or X64Emitter
+// changes what they emit.
+constexpr int JIT_VERSION = 1;
+
+struct JitDiskHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t quirks;
+    uint64_t romHash;
+    int32_t  offV, offI, offPc;
+    uint32_t count;
+};
+
+// Followed by addr[marked + checked], opcode[marked + checked] and size
+// bytes of code, padded to 8. marked are the compiled instructions;
+// checked are words the walk looked at without compiling them.
+struct JitDiskEntry {
+    uint16_t start;
+    uint16_t marked;
+    uint16_t checked;
+    uint16_t reserved;
+    uint32_t maxPath;
+    uint32_t size;
+
+    const uint16_t* Addrs() const { return reinterpret_cast<const uint16_t*>(this + 1); }
+    const uint16_t* Opcodes() const { return Addrs() + marked + checked; }
+    const uint8_t* Code() const { return reinterpret_cast<const uint8_t*>(Opcodes() + marked + checked); }
+    size_t Bytes() const { return (sizeof(*this) + 4u * (marked + checked) + size + 7) & ~size_t(7); }
+};
+
+struct Chip8::JitCache {
+    uint8_t* buffer;
+    size_t   used;
+    std::unordered_map<uint16_t, JitRegion> regions;
+    CodeMap  code;
+
+    // On-disk copy, see OpenJitCache. path is empty when there is none.
+    std::string    path;
+    JitDiskHeader  header;
+    const uint8_t* image;
+    size_t         imageSize;
+    std::unordered_map<uint16_t, const JitDiskEntry*> stored;
+    std::unordered_map<uint16_t, std::vector<uint8_t>> fresh;
+
+    JitCache() : buffer(nullptr), used(0), header(), image(nullptr), imageSize(0) {
+#if CHIP8_HAVE_JIT
+        void* p = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (p != MAP_FAILED) buffer = static_cast<uint8_t*>(p);
+#endif
+    }
+
+    ~JitCache() {
+#if CHIP8_HAVE_JIT
+        Save();
+        if (image) munmap(const_cast<uint8_t*>(image), imageSize);
+        if (buffer) munmap(buffer, JIT_CODE_SIZE);
+#endif
+    }
+
+    void Record(uint16_t start, const std::vector<IrOp>& steps, const std::vector<uint16_t>& checked,
+                const Chip8& machine, uint32_t maxPath, const uint8_t* fn, uint32_t size);
+    void Save();
+
+    void Flush() {
+        regions.clear();
+        code.Clear();
+        used = 0;
+    }
+};
+
+// Shared with the generated translation unit, which gets the same text
+// through AOT_STATE_SOURCE. Bump AOT_VERSION whenever either side changes.
+#define CHIP8_AOT_STATE                                         \
+    struct AotState {                                           \
+        uint8_t*       V;                                       \
+        uint32_t*      I;                                       \
+        uint16_t*      pc;                                      \
+        uint8_t*       sp;                                      \
+        uint16_t*      stack;                                   \
+        uint8_t*       delay_timer;                             \
+        uint8_t*       sound_timer;                             \
+        const uint8_t* keypad;                                  \
+        uint64_t*      display;                                 \
+        bool*          drawFlag;                                \
+        uint64_t*      faults;                                  \
+        const bool*    stale;                                   \
+        const uint8_t* stop;                                    \
+        void*          machine;                                 \
+        void         (*exec)(void* machine, uint16_t opcode);   \
+    };
+#define CHIP8_STRINGIFY_(...) #__VA_ARGS__
+#define CHIP8_STRINGIFY(...) CHIP8_STRINGIFY_(__VA_ARGS__)
+
+CHIP8_AOT_STATE
+static const char* const AOT_STATE_SOURCE = CHIP8_STRINGIFY(CHIP8_AOT_STATE);
+constexpr int AOT_VERSION = 9;
+// Past this the compiler takes minutes; such ROMs stay interpreted.
+constexpr size_t AOT_MAX_SOURCE = 2u << 20;
+
+using AotRunFn = uint32_t (*)(AotState* state, uint32_t budget);
+
+struct Chip8::AotModule {
+    void*    handle;
+    AotRunFn run;       // nullptr: not available, interpret everything
+    AotState state;
+    CodeMap  code;      // reachable code baked into the module
+
+    AotModule() : handle(nullptr), run(nullptr), state() {}
+    ~AotModule() {
+#if CHIP8_HAVE_AOT
+        if (handle) dlclose(handle);
+#endif
+    }
+};
+
+// What only MegaChip machines carry: the 16 MB address space and the
+// indexed-colour screen. Allocated when the profile is selected.
+struct Chip8::MegaState {
+    std::vector<uint8_t> ram;  // MEGA_MEMORY_SIZE + GUARD_SIZE
+    alignas(16) uint8_t screen[MEGA_WIDTH * MEGA_HEIGHT];
+    uint32_t palette[MEGA_COLORS];  // ARGB; 02NN loads from entry 1, 0 is transparent
+
+    MegaState() : ram(MEGA_MEMORY_SIZE + GUARD_SIZE, 0), screen(), palette() {}
+};
+
+const uint8_t* Chip8::GetMegaScreen() const { return mega ? mega->screen : nullptr; }
+const uint32_t* Chip8::GetMegaPalette() const { return mega ? mega->palette : nullptr; }
+
+// The VIP as hardware for the LLE engine: a CDP1802 whose RAM is the
+// owning machine's memory[], and a CDP1861 that DMAs scanlines into its
+// display[]. The 1861 frame is 262 lines of 14 machine cycles; INT comes
+// two lines before the 128 display lines, each of which takes 8 DMA
+// cycles, and EF1 flags the four lines either side of the display's end.
+constexpr int VIP_LINE_CYCLES   = 14;
+constexpr int VIP_INT_LINE      = 78;
+constexpr int VIP_DISPLAY_LINE  = 80;
+constexpr int VIP_DISPLAY_LINES = 128;
+constexpr int VIP_DMA_OFFSET    = 1;     // first DMA 29 cycles after INT
+constexpr int VIP_MONITOR_SIZE  = 512;   // at 0x8000, mirrored to 0xFFFF
+// Where the VIP interpreter keeps CHIP-8 state in a 4K machine.
+constexpr int VIP_VREG_ADDR     = 0x0EF0;
+static_assert(VIP_CYCLES_PER_FRAME == 262 * VIP_LINE_CYCLES);
+static_assert(VIP_DMA_CYCLES == VIP_DISPLAY_LINES * 8);
+
+struct Chip8::Cosmac {
+    using Handler = void (*)(Cosmac&);
+    static std::vector<uint8_t> monitor;
+    static std::vector<uint8_t> interpreter;
+
+    uint16_t R[16] = {};
+    uint8_t  D = 0, P = 0, X = 0, T = 0;
+    bool     DF = false, IE = true, Q = false;
+    bool     idle = false;        // in IDL until DMA or INT
+    bool     bootMap = true;      // reads come from ROM until A15 is first set
+    bool     displayOn = false;   // 1861 enabled by INP 1, disabled by OUT 1
+    bool     ef1 = false;
+    bool     intPending = false;  // INT raised while IE was clear
+    bool     stopOnQ = false;
+    bool     qChanged = false;
+    uint8_t  keyLatch = 0;        // key selected by OUT 2; EF3 reads it
+    uint64_t now = 0;             // machine cycles since reset
+    uint64_t frameStart = 0;
+    uint32_t nextEvent = 0;
+    uint64_t limit = 0;           // end of the current run of instructions
+    uint8_t*       ram;
+    uint64_t*      display;
+    const uint8_t* keypad;
+
+    Cosmac(uint8_t* ram, uint64_t* display, const uint8_t* keypad)
+        : ram(ram), display(display), keypad(keypad) {}
+
+    uint8_t Read(uint16_t addr) {
+        if (addr & 0x8000) {
+            bootMap = false;
+            return monitor[addr & (VIP_MONITOR_SIZE - 1)];
+        }
+        return bootMap ? monitor[addr & (VIP_MONITOR_SIZE - 1)] : ram[addr & (MEMORY_SIZE - 1)];
+    }
+    void Write(uint16_t addr, uint8_t value) {
+        if (!(addr & 0x8000)) ram[addr & (MEMORY_SIZE - 1)] = value;
+    }
+
+    uint32_t Run(uint64_t until);
+    template <uint8_t OP> static void Exec(Cosmac& c);
+    template <size_t... OPS>
+    static constexpr std::array<Handler, 256> MakeTable(std::index_sequence<OPS...>);
+    static const std::array<Handler, 256> handlers;
+
+private:
+    bool Ef(int n) const;
+    void Output(int port, uint8_t value);
+    uint8_t Input(int port);
+    void Interrupt();
+    void Dma(int line);
+    void Add(unsigned a, unsigned b, unsigned carry) {
+        unsigned sum = a + b + carry;
+        D = static_cast<uint8_t>(sum);
+        DF = sum >> 8;
+    }
+};
+
+constexpr Chip8::Chip8() : memory(ram), memSize(MEMORY_SIZE), I(0), pc(START_ADDR), sp(0), delay_timer(0), sound_timer(0),
+                 hires(false), planeMask(1), pitch(64), megaOn(false), spriteWidth(1), spriteHeight(1),
+                 collisionColor(0), drawFlag(false),
+                 engine(Engine::Switch), quirks(Quirks::Legacy),
+                 handlers(nullptr), ids(nullptr), fusionEnabled(true), idleSkip(true), idleCycles(0), faults(0), rngSeed(0), rng{},
+                 lazyFlags(false), pendingFlag(0), stopOn(0), stopHit(0),
+                 halted(false), haltReg(0), haltKey(-1), timing(Timing::Flat), flatHz(CPU_HZ),
+                 cycleCount(0), timingEpoch(0), timerTicks(0), romSize(0), romHash(0) {
+    // The handler tables are built at run time; constant evaluation only
+    // uses the switch engine.
+    if (!std::is_constant_evaluated()) {
+        handlers = tables.handler;
+        ids = tables.id;
+    }
+    Reset();
+}
+
+constexpr void Chip8::Reset() {
+    std::fill_n(memory, memSize + GUARD_SIZE, 0);
+    std::fill_n(V, 16, 0);
+    std::fill_n(stack, STACK_SIZE, 0);
+    std::fill_n(keypad, 16, 0);
+    for (uint64_t* rows : display) std::fill_n(rows, DISPLAY_HEIGHT, 0);
+    for (uint64_t* rows : plane) std::fill_n(rows, HIRES_HEIGHT * 2, 0);
+    std::fill_n(rpl, 16, 0);
+    hires = false;
+    planeMask = 1;
+    // A square wave at the default pitch, for ROMs that never load one.
+    for (int i = 0; i < AUDIO_PATTERN_SIZE; ++i) audio[i] = i & 1 ? 0x00 : 0xFF;
+    pitch = 64;
+    megaOn = false;
+    spriteWidth = spriteHeight = 1;
+    collisionColor = 0;
+    if (mega) {
+        std::fill_n(mega->screen, MEGA_WIDTH * MEGA_HEIGHT, 0);
+        std::fill_n(mega->palette, MEGA_COLORS, 0);
+    }
+    decoded.clear();
+    blockCache.reset();
+    jit.reset();
+    aot.reset();
+    lle.reset();
+    romSize = 0;
+    romHash = 0;
+    idleCycles = 0;
+    faults = 0;
+    SeedRandom(rngSeed);
+    pendingFlag = 0;
+    stopHit = 0;
+    halted = false;
+    haltKey = -1;
+    cycleCount = 0;
+    timingEpoch = 0;
+    timerTicks = 0;
+    std::copy_n(fontset, FONTSET_SIZE, &memory[FONTSET_ADDR]);
+    std::copy_n(bigfont, BIGFONT_SIZE, &memory[BIGFONT_ADDR]);
+    std::copy_n(memory, GUARD_SIZE, &memory[memSize]);
+    pc = START_ADDR;
+    I = 0;
+    sp = 0;
+    delay_timer = 0;
+    sound_timer = 0;
+    drawFlag = false;
+}
+
+bool Chip8::SameState(const Chip8& other) const {
+    return std::memcmp(V, other.V, sizeof(V)) == 0 &&
+           I == other.I && pc == other.pc && sp == other.sp && halted == other.halted &&
+           faults == other.faults && std::memcmp(rng.s, other.rng.s, sizeof(rng.s)) == 0 &&
+           std::memcmp(stack, other.stack, sizeof(stack)) == 0 &&
+           DelayTimer() == other.DelayTimer() && SoundTimer() == other.SoundTimer() &&
+           memSize == other.memSize && std::memcmp(memory, other.memory, memSize + GUARD_SIZE) == 0 &&
+           std::memcmp(display, other.display, sizeof(display)) == 0 &&
+           hires == other.hires && std::memcmp(plane, other.plane, sizeof(plane)) == 0 &&
+           planeMask == other.planeMask && std::memcmp(rpl, other.rpl, sizeof(rpl)) == 0 &&
+           std::memcmp(audio, other.audio, sizeof(audio)) == 0 && pitch == other.pitch &&
+           megaOn == other.megaOn && spriteWidth == other.spriteWidth &&
+           spriteHeight == other.spriteHeight && collisionColor == other.collisionColor &&
+           (!mega || (std::memcmp(mega->screen, other.mega->screen, sizeof(mega->screen)) == 0 &&
+                      std::memcmp(mega->palette, other.mega->palette, sizeof(mega->palette)) == 0));
+}
+
+void Chip8::LoadROM(const std::string& filename) {
+    Reset();
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        std::cerr << "Error: Could not open ROM file " << filename << std::endl;
+        return;
+    }
+    std::streamsize size = file.tellg();
+    file.seekg(0, std::ios::beg);
+    if (size > memSize - START_ADDR) {
+        std::cerr << "Error: ROM too large" << std::endl;
+        return;
+    }
+    std::vector<uint8_t> rom(static_cast<size_t>(size));
+    file.read(reinterpret_cast<char*>(rom.data()), size);
+    file.close();
+    LoadROM(rom.data(), rom.size());
+}
+
+// Resets and loads size bytes at START_ADDR; false if they do not fit.
+constexpr bool Chip8::LoadROM(const uint8_t* data, size_t size) {
+    Reset();
+    if (size > memSize - START_ADDR) return false;
+    std::copy_n(data, size, &memory[START_ADDR]);
+    InvalidateDecoded(START_ADDR, static_cast<uint16_t>(size));
+    romSize = static_cast<uint32_t>(size);
+    romHash = HashBytes(&memory[START_ADDR], romSize);
+    return true;
+}
+
+template <class Q>
+const Chip8::OpTables& Chip8::BuildTables() {
+    static const OpFn byId[OP_COUNT] = {
+        &Thunk<&Chip8::OpNop>,
+        &Thunk<&Chip8::Op00E0>, &Thunk<&Chip8::Op00EE>,
+        &Thunk<&Chip8::Op00Cn<Q>>, &Thunk<&Chip8::Op00FB<Q>>, &Thunk<&Chip8::Op00FC<Q>>,
+        &Thunk<&Chip8::Op00FD<Q>>, &Thunk<&Chip8::Op00FE<Q>>, &Thunk<&Chip8::Op00FF<Q>>,
+        &Thunk<&Chip8::Op00Dn<Q>>,
+        &Thunk<&Chip8::Op001N<Q>>, &Thunk<&Chip8::Op00Bn<Q>>, &Thunk<&Chip8::Op01nn<Q>>,
+        &Thunk<&Chip8::Op0xnn<Q>>,
+        &Thunk<&Chip8::Op1nnn>, &Thunk<&Chip8::Op2nnn>, &Thunk<&Chip8::Op3xkk<Q>>,
+        &Thunk<&Chip8::Op4xkk<Q>>, &Thunk<&Chip8::Op5xy0<Q>>, &Thunk<&Chip8::Op5xy2<Q>>,
+        &Thunk<&Chip8::Op5xy3<Q>>, &Thunk<&Chip8::Op6xkk>,
+        &Thunk<&Chip8::Op7xkk>,
+        &Thunk<&Chip8::Op8xy0>, &Thunk<&Chip8::Op8xy1<Q>>, &Thunk<&Chip8::Op8xy2<Q>>,
+        &Thunk<&Chip8::Op8xy3<Q>>, &Thunk<&Chip8::Op8xy4>, &Thunk<&Chip8::Op8xy5>,
+        &Thunk<&Chip8::Op8xy6<Q>>, &Thunk<&Chip8::Op8xy7>, &Thunk<&Chip8::Op8xyE<Q>>,
+        &Thunk<&Chip8::Op9xy0<Q>>, &Thunk<&Chip8::OpAnnn>, &Thunk<&Chip8::OpBnnn<Q>>,
+        &Thunk<&Chip8::OpCxkk>, &Thunk<&Chip8::OpDxyn<Q>>,
+        &Thunk<&Chip8::OpEx9E<Q>>, &Thunk<&Chip8::OpExA1<Q>>,
+        &Thunk<&Chip8::OpFx07>, &Thunk<&Chip8::OpFx0A>, &Thunk<&Chip8::OpFx15>,
+        &Thunk<&Chip8::OpFx18>, &Thunk<&Chip8::OpFx1E<Q>>, &Thunk<&Chip8::OpFx29>,
+        &Thunk<&Chip8::OpFx33>, &Thunk<&Chip8::OpFx55<Q>>, &Thunk<&Chip8::OpFx65<Q>>,
+        &Thunk<&Chip8::OpFx30<Q>>, &Thunk<&Chip8::OpFx75<Q>>, &Thunk<&Chip8::OpFx85<Q>>,
+        &Thunk<&Chip8::OpF000<Q>>, &Thunk<&Chip8::OpFn01<Q>>, &Thunk<&Chip8::OpF002<Q>>,
+        &Thunk<&Chip8::OpFx3A<Q>>,
+    };
+    OpTables* t = new OpTables;
+    for (uint32_t op = 0; op < 0x10000; ++op) {
+        OpId id = ClassifyOpcode<Q>(static_cast<uint16_t>(op));
+        t->id[op] = id;
+        t->handler[op] = byId[id];
+    }
+    return *t;
+}
+
+// Built on first use, so profiles nobody selects cost nothing.
+template <class Q>
+const Chip8::OpTables& Chip8::TablesFor() {
+    static const OpTables& t = BuildTables<Q>();
+    return t;
+}
+
+const Chip8::OpTables& Chip8::tables = Chip8::TablesFor<LegacyQuirks>();
+
+constexpr void Chip8::SetQuirks(Quirks q) {
+    SyncFlags();
+    quirks = q;
+    if (!std::is_constant_evaluated()) {
+        const OpTables& t = WithQuirks(q, [](auto p) -> const OpTables& { return TablesFor<decltype(p)>(); });
+        handlers = t.handler;
+        ids = t.id;
+    }
+    uint32_t size = WithQuirks(q, [](auto p) -> uint32_t {
+        using Q = decltype(p);
+        return Q::megaChip ? MEGA_MEMORY_SIZE : Q::xoChip ? XO_MEMORY_SIZE : MEMORY_SIZE;
+    });
+    if (size != memSize) {
+        // Memory newly in range starts clear; the guard band moves to the end.
+        uint8_t* next = ram;
+        if (size > XO_MEMORY_SIZE) {
+            if (!mega) mega.reset(new MegaState);
+            next = mega->ram.data();
+        }
+        if (next != memory) std::copy_n(memory, std::min(memSize, size), next);
+        if (size > memSize) std::fill_n(&next[memSize], size - memSize, 0);
+        memory = next;
+        memSize = size;
+        std::copy_n(memory, GUARD_SIZE, &memory[memSize]);
+        if (memory == ram) {
+            mega.reset();
+            megaOn = false;
+        }
+    }
+    // Every cache has the old behaviour baked in.
+    decoded.clear();
+    blockCache.reset();
+    jit.reset();
+    aot.reset();
+}
+
+// One instruction. In constant evaluation this is the switch engine on
+// its own, with guest time counted in instructions; the other engines,
+// idle skipping and the VIP cost model are run-time machinery.
+constexpr void Chip8::Cycle() {
+    if (!std::is_constant_evaluated()) {
+        RunCycles(1, 0);
+        return;
+    }
+    SyncTimers();
+    if (!halted) WithQuirks(quirks, [this](auto q) { StepSwitch<decltype(q)>(); });
+    stopHit = 0;
+    ++cycleCount;
+}
+
+// One instruction in the current engine, with no timekeeping.
+void Chip8::Step() {
+    switch (engine) {
+        case Engine::Switch:
+            WithQuirks(quirks, [this](auto q) { StepSwitch<decltype(q)>(); });
+            break;
+        case Engine::Table:      StepTable(); break;
+        case Engine::Threaded:
+            WithQuirks(quirks, [this](auto q) { RunThreaded<decltype(q)>(1); });
+            break;
+        case Engine::Predecoded: StepPredecoded(); break;
+        case Engine::Block:      RunBlocks(1); break;
+        case Engine::Jit:        RunJit(1); break;
+        case Engine::Aot:        RunAot(1); break;
+        case Engine::Lle:        RunLle(1, false, 0); break;
+    }
+    SyncFlags();
+}
+
+// Idle skipping probes for a wait loop at least this often.
+constexpr uint32_t IDLE_PROBE_SLICE = 8192;
+
+static Chip8::StopReason FirstStopReason(uint8_t events) {
+    if (events & Chip8::STOP_DRAW) return Chip8::StopReason::Draw;
+    if (events & Chip8::STOP_SOUND) return Chip8::StopReason::Sound;
+    if (events & Chip8::STOP_KEY_WAIT) return Chip8::StopReason::KeyWait;
+    return Chip8::StopReason::Budget;
+}
+
+// Runs up to count cycles in the engine's own loop. Handlers raise the
+// events in stopOn through stopHit and the engines leave as soon as they
+// see it, so a batch ends right after the instruction that caused it.
+Chip8::RunResult Chip8::RunCycles(uint32_t count, uint8_t events) {
+    if (engine == Engine::Lle) return RunLle(count, false, events);
+    stopOn = events;
+    stopHit = 0;
+    RunResult result = {0, 0, StopReason::Budget};
+    if (timing == Timing::Vip) {
+        result = RunCosted(count, UINT64_MAX);
+    } else if ((stopOn & STOP_BREAKPOINT) && !breakpoints.empty()) {
+        result = RunDebug(count);
+    } else {
+        while (count > 0) {
+            if (halted) {
+                // Nothing runs until SetKey() wakes the core; only guest
+                // time passes.
+                if (stopOn & STOP_KEY_WAIT) {
+                    result.reason = StopReason::KeyWait;
+                } else {
+                    result.elided += count;
+                    cycleCount += count;
+                }
+                break;
+            }
+            // The timers only change on a tick, so no slice crosses one and
+            // the engines can read them straight from the fields.
+            SyncTimers();
+            uint32_t span = static_cast<uint32_t>(std::min<uint64_t>(count, NextTickAt() - cycleCount));
+            // Whole trips round a wait loop leave the state unchanged, so
+            // drop them and run only the remainder. Only the timer wait
+            // (period 3) can be released by a tick; a jump to self never is.
+            bool settling = false;
+            if (idleSkip) {
+                if (uint32_t period = IdlePeriod(settling)) {
+                    uint32_t limit = period == 3 ? span : count;
+                    uint32_t skip = limit - limit % period;
+                    result.elided += skip;
+                    cycleCount += skip;
+                    count -= skip;
+                    if (skip >= span) continue;
+                    span -= skip;
+                }
+            }
+            // A timer wait whose register is stale needs one trip to settle.
+            uint32_t slice = std::min(span, settling ? 3u : IDLE_PROBE_SLICE);
+            uint32_t ran = Run(slice);
+            result.executed += ran;
+            cycleCount += ran;
+            count -= ran;
+            if (stopHit & ~STOP_HALT) {
+                result.reason = FirstStopReason(stopHit);
+                break;
+            }
+            stopHit = 0;
+        }
+        idleCycles += result.elided;
+    }
+    stopOn = 0;
+    return result;
+}
+
+// Single-steps so every pc can be checked. The first instruction never
+// stops, so resuming from a breakpoint makes progress.
+Chip8::RunResult Chip8::RunDebug(uint32_t count) {
+    RunResult result = {0, 0, StopReason::Budget};
+    while (result.executed < count) {
+        if (halted) {
+            if (stopOn & STOP_KEY_WAIT) {
+                result.reason = StopReason::KeyWait;
+            } else {
+                result.elided = count - result.executed;
+                cycleCount += result.elided;
+            }
+            break;
+        }
+        if (result.executed > 0 && breakpoints[pc & (memSize - 1)]) {
+            result.reason = StopReason::Breakpoint;
+            break;
+        }
+        SyncTimers();
+        Step();
+        ++cycleCount;
+        ++result.executed;
+        if (stopHit & ~STOP_HALT) {
+            result.reason = FirstStopReason(stopHit);
+            break;
+        }
+        stopHit = 0;
+    }
+    return result;
+}
+
+// One 60 Hz frame of guest time: runs up to the next timer tick under the
+// timing model. A batch that stops early leaves the rest of the frame to
+// the next call; an instruction that overruns the frame borrows from the
+// next one. A stop raised by the frame's last instruction still reports
+// Budget, so callers looping until then never run a frame too many.
+Chip8::RunResult Chip8::RunFrame(uint8_t events) {
+    if (engine == Engine::Lle) return RunLle(0, true, events);
+    uint64_t end = NextTickAt();
+    RunResult result;
+    if (timing == Timing::Flat) {
+        result = RunCycles(static_cast<uint32_t>(end - cycleCount), events);
+    } else {
+        stopOn = events;
+        stopHit = 0;
+        result = RunCosted(UINT32_MAX, end);
+        stopOn = 0;
+    }
+    if (cycleCount >= end) result.reason = StopReason::Budget;
+    return result;
+}
+
+void Chip8::SetTiming(Timing t, uint32_t hz) {
+    // Ticks are counted from here under the new model.
+    SyncTimers();
+    timing = t;
+    flatHz = std::max<uint32_t>(hz, TIMER_HZ);
+    timingEpoch = cycleCount;
+    timerTicks = 0;
+}
+
+// Timer ticks due by guest time t. Under Flat the tick boundaries are
+// flatHz spread over TIMER_HZ frames, the remainder carried so the
+// long-run rate is exact.
+constexpr uint64_t Chip8::TicksAt(uint64_t t) const {
+    t -= timingEpoch;
+    if (timing == Timing::Vip) return t / VIP_FRAME_CYCLES;
+    return (t * TIMER_HZ + TIMER_HZ - 1) / flatHz;
+}
+
+// Guest time of the first tick after now.
+uint64_t Chip8::NextTickAt() const {
+    uint64_t next = TicksAt(cycleCount) + 1;
+    if (timing == Timing::Vip) return timingEpoch + next * VIP_FRAME_CYCLES;
+    return timingEpoch + next * flatHz / TIMER_HZ;
+}
+
+static constexpr uint8_t Elapse(uint8_t timer, uint64_t ticks) {
+    return ticks >= timer ? 0 : static_cast<uint8_t>(timer - ticks);
+}
+
+// Brings the timer fields up to the current guest time.
+constexpr void Chip8::SyncTimers() {
+    uint64_t now = TicksAt(cycleCount);
+    if (now == timerTicks) return;
+    delay_timer = Elapse(delay_timer, now - timerTicks);
+    sound_timer = Elapse(sound_timer, now - timerTicks);
+    timerTicks = now;
+}
+
+constexpr uint8_t Chip8::DelayTimer() const {
+    return Elapse(delay_timer, TicksAt(cycleCount) - timerTicks);
+}
+
+constexpr uint8_t Chip8::SoundTimer() const {
+    return Elapse(sound_timer, TicksAt(cycleCount) - timerTicks);
+}
+
+// VIP machine cycles for in, not counting a taken skip.
+int32_t Chip8::VipCost(const Instr& in) const {
+    uint8_t id = ids[in.opcode];
+    int32_t cost = VIP_FETCH_CYCLES + VIP_OP_CYCLES[id];
+    switch (id) {
+        case OP_DXYN:
+            // A sprite not on a byte boundary is shifted across two bytes.
+            cost += in.n * ((V[in.x] & 7) ? 68 : 46);
+            break;
+        case OP_FX33:
+            // Digits come out by repeated subtraction.
+            cost += 16 * (V[in.x] / 100 + V[in.x] / 10 % 10 + V[in.x] % 10);
+            break;
+        case OP_FX55:
+        case OP_FX65:
+            cost += 14 * (in.x + 1);
+            break;
+        case OP_5XY2:
+        case OP_5XY3:
+            cost += 14 * (in.x > in.y ? in.x - in.y + 1 : in.y - in.x + 1);
+            break;
+        default:
+            break;
+    }
+    return cost;
+}
+
+// Runs up to count instructions or until guest time reaches until, one
+// instruction at a time: costs depend on operands and on whether a skip
+// was taken, and at VIP speed a frame is only a few dozen instructions.
+Chip8::RunResult Chip8::RunCosted(uint32_t count, uint64_t until) {
+    bool debug = (stopOn & STOP_BREAKPOINT) && !breakpoints.empty();
+    RunResult result = {0, 0, StopReason::Budget};
+    while (count > 0 && cycleCount < until) {
+        if (halted) {
+            if (stopOn & STOP_KEY_WAIT) {
+                result.reason = StopReason::KeyWait;
+                break;
+            }
+            // Time passes as Fx0A polls, to the end of the batch.
+            uint64_t poll = VIP_FETCH_CYCLES + VIP_OP_CYCLES[OP_FX0A];
+            uint64_t polls = count;
+            if (until != UINT64_MAX) polls = std::min(polls, (until - cycleCount + poll - 1) / poll);
+            result.elided += static_cast<uint32_t>(polls);
+            count -= static_cast<uint32_t>(polls);
+            cycleCount += polls * poll;
+            break;
+        }
+        SyncTimers();
+        bool settling;
+        uint32_t period = idleSkip && !debug ? IdlePeriod(settling) : 0;
+        if (period) {
+            // Drop whole trips round the loop, as RunCycles() does.
+            uint64_t trip = 0;
+            uint16_t at = pc & (memSize - 1);
+            for (uint32_t i = 0; i < period; ++i) {
+                Instr in = DecodeInstr(ReadOpcode(at));
+                trip += VipCost(in);
+                at = ids[in.opcode] == OP_1NNN ? in.nnn : (at + 2) & (memSize - 1);
+            }
+            uint64_t horizon = period == 3 ? std::min(until, NextTickAt()) : until;
+            uint64_t trips = std::min<uint64_t>(count / period, (horizon - cycleCount) / trip);
+            result.elided += static_cast<uint32_t>(trips * period);
+            count -= static_cast<uint32_t>(trips * period);
+            cycleCount += trips * trip;
+            // Back round so a tick the trips ran up to is applied first.
+            if (trips) continue;
+        }
+        uint16_t from = pc & (memSize - 1);
+        if (debug && result.executed > 0 && breakpoints[from]) {
+            result.reason = StopReason::Breakpoint;
+            break;
+        }
+        Instr in = DecodeInstr(ReadOpcode(from));
+        uint64_t cost = VipCost(in);
+        uint32_t ran = Run(1);
+        if (IsSkip(ids[in.opcode]) && ((pc - from) & (memSize - 1)) != 2) {
+            cost += VIP_SKIP_CYCLES;
+        }
+        cycleCount += cost;
+        result.executed += ran;
+        count -= ran;
+        if (stopHit & ~STOP_HALT) {
+            result.reason = FirstStopReason(stopHit);
+            break;
+        }
+        stopHit = 0;
+    }
+    idleCycles += result.elided;
+    return result;
+}
+
+// Completes a halted Fx0A on the release of a key pressed since it
+// started; a key already down then has to be pressed again.
+constexpr void Chip8::SetKey(int key, bool pressed) {
+    keypad[key] = pressed;
+    if (!halted) return;
+    if (pressed) {
+        if (haltKey < 0) haltKey = static_cast<int8_t>(key);
+    } else if (key == haltKey) {
+        V[haltReg] = static_cast<uint8_t>(key);
+        halted = false;
+    }
+}
+
+void Chip8::SetBreakpoint(uint16_t addr, bool enabled) {
+    if (breakpoints.empty()) {
+        if (!enabled) return;
+        breakpoints.assign(XO_MEMORY_SIZE, 0);
+    }
+    breakpoints[addr] = enabled;
+}
+
+// Length in instructions of the busy-wait loop pc is sitting in, or 0.
+// settling is set for a timer wait that has not re-read the timer since
+// it last changed. Recognised, once the loop has reached its steady state:
+//   Fx07; 3xkk; 1NNN  (or 4xkk)  waiting on the delay timer
+//   1NNN              jump to self
+//   00FD              SUPER-CHIP exit
+uint32_t Chip8::IdlePeriod(bool& settling) const {
+    settling = false;
+    uint16_t at = pc & (memSize - 1);
+    uint16_t opcode = ReadOpcode(at);
+    uint8_t id = ids[opcode];
+    if (id == OP_1NNN && (opcode & 0x0FFF) == at) return 1;
+    if (id == OP_00FD) return 1;
+    if (id != OP_FX07 && id != OP_3XKK && id != OP_4XKK && id != OP_1NNN) return 0;
+
+    for (int phase = 0; phase <= 4; phase += 2) {
+        if (at < phase) break;
+        uint16_t top = at - phase;
+        if (top + 6u > memSize) continue;
+        Instr load = DecodeInstr(ReadOpcode(top));
+        Instr test = DecodeInstr(ReadOpcode(top + 2));
+        uint16_t jump = ReadOpcode(top + 4);
+        if (ids[load.opcode] != OP_FX07 || jump != (0x1000 | top)) continue;
+        uint8_t testId = ids[test.opcode];
+        if (test.x != load.x || (testId != OP_3XKK && testId != OP_4XKK)) continue;
+        uint8_t delay = DelayTimer();
+        if (V[load.x] != delay) {
+            settling = true;
+            continue;
+        }
+        if (testId == OP_3XKK && delay != test.kk) return 3;
+        if (testId == OP_4XKK && delay == test.kk) return 3;
+    }
+    return 0;
+}
+
+// Returns the number of instructions executed.
+uint32_t Chip8::Run(uint32_t count) {
+    uint32_t left = count;
+    switch (engine) {
+        case Engine::Switch:
+            left = WithQuirks(quirks, [&](auto q) { return RunSwitch<decltype(q)>(count); });
+            break;
+        case Engine::Table:
+            while (left > 0) {
+                StepTable();
+                --left;
+                if (stopHit) break;
+            }
+            break;
+        case Engine::Threaded:
+            left = WithQuirks(quirks, [&](auto q) { return RunThreaded<decltype(q)>(count); });
+            break;
+        case Engine::Predecoded: left = RunPredecoded(count); break;
+        case Engine::Block:      left = RunBlocks(count); break;
+        case Engine::Jit:        left = RunJit(count); break;
+        case Engine::Aot:        left = RunAot(count); break;
+        case Engine::Lle:        RunLle(count, false, 0); left = 0; break;
+    }
+    // Engines that run outside the decoded ops read V[] directly.
+    SyncFlags();
+    return count - left;
+}
+
+template <class Q>
+uint32_t Chip8::RunSwitch(uint32_t count) {
+    while (count > 0) {
+        StepSwitch<Q>();
+        --count;
+        if (stopHit) break;
+    }
+    return count;
+}
+
+template <class Q>
+constexpr void Chip8::StepSwitch() {
+    ExecuteSwitch<Q>(DecodeInstr(Fetch()));
+}
+
+template <class Q>
+constexpr void Chip8::ExecuteSwitch(const Instr& in) {
+    switch (in.opcode >> 12) {
+        case 0x0: Opcode0xxx<Q>(in); break;
+        case 0x1: Op1nnn(in); break;
+        case 0x2: Op2nnn(in); break;
+        case 0x3: Op3xkk<Q>(in); break;
+        case 0x4: Op4xkk<Q>(in); break;
+        case 0x5: Opcode5xxx<Q>(in); break;
+        case 0x6: Op6xkk(in); break;
+        case 0x7: Op7xkk(in); break;
+        case 0x8: Opcode8xxx<Q>(in); break;
+        case 0x9: Op9xy0<Q>(in); break;
+        case 0xA: OpAnnn(in); break;
+        case 0xB: OpBnnn<Q>(in); break;
+        case 0xC: OpCxkk(in); break;
+        case 0xD: OpDxyn<Q>(in); break;
+        case 0xE: OpcodeExxx<Q>(in); break;
+        case 0xF: OpcodeFxxx<Q>(in); break;
+        default: break;
+    }
+}
+
+void Chip8::StepTable() {
+    uint16_t opcode = Fetch();
+    handlers[opcode](*this, DecodeInstr(opcode));
+}
+
+template <class Q>
+uint32_t Chip8::RunThreaded(uint32_t count) {
+#if defined(__GNUC__)
+    // Each handler ends in its own indirect jump, so the host branch
+    // predictor sees per-instruction history instead of one shared switch.
+    static const void* const labels[OP_COUNT] = {
+        &&op_nop,
+        &&op_00e0, &&op_00ee, &&op_00cn, &&op_00fb, &&op_00fc, &&op_00fd, &&op_00fe, &&op_00ff,
+        &&op_00dn, &&op_001n, &&op_00bn, &&op_01nn, &&op_0xnn,
+        &&op_1nnn, &&op_2nnn, &&op_3xkk, &&op_4xkk, &&op_5xy0, &&op_5xy2, &&op_5xy3, &&op_6xkk,
+        &&op_7xkk,
+        &&op_8xy0, &&op_8xy1, &&op_8xy2, &&op_8xy3, &&op_8xy4, &&op_8xy5, &&op_8xy6,
+        &&op_8xy7, &&op_8xye,
+        &&op_9xy0, &&op_annn, &&op_bnnn, &&op_cxkk, &&op_dxyn,
+        &&op_ex9e, &&op_exa1,
+        &&op_fx07, &&op_fx0a, &&op_fx15, &&op_fx18, &&op_fx1e, &&op_fx29, &&op_fx33,
+        &&op_fx55, &&op_fx65,
+        &&op_fx30, &&op_fx75, &&op_fx85,
+        &&op_f000, &&op_fn01, &&op_f002, &&op_fx3a,
+    };
+    uint16_t opcode;
+    Instr in;
+
+#define THREADED_NEXT()                          \
+    do {                                         \
+        if (count == 0 || stopHit) return count; \
+        --count;                                 \
+        opcode = Fetch();                        \
+        in = DecodeInstr(opcode);                \
+        goto *labels[ids[opcode]];               \
+    } while (0)
+
+    THREADED_NEXT();
+op_nop:  THREADED_NEXT();
+op_00e0: Op00E0(in); THREADED_NEXT();
+op_00ee: Op00EE(in); THREADED_NEXT();
+op_00cn: Op00Cn<Q>(in); THREADED_NEXT();
+op_00fb: Op00FB<Q>(in); THREADED_NEXT();
+op_00fc: Op00FC<Q>(in); THREADED_NEXT();
+op_00fd: Op00FD<Q>(in); THREADED_NEXT();
+op_00fe: Op00FE<Q>(in); THREADED_NEXT();
+op_00ff: Op00FF<Q>(in); THREADED_NEXT();
+op_00dn: Op00Dn<Q>(in); THREADED_NEXT();
+op_001n: Op001N<Q>(in); THREADED_NEXT();
+op_00bn: Op00Bn<Q>(in); THREADED_NEXT();
+op_01nn: Op01nn<Q>(in); THREADED_NEXT();
+op_0xnn: Op0xnn<Q>(in); THREADED_NEXT();
+op_1nnn: Op1nnn(in); THREADED_NEXT();
+op_2nnn: Op2nnn(in); THREADED_NEXT();
+op_3xkk: Op3xkk<Q>(in); THREADED_NEXT();
+op_4xkk: Op4xkk<Q>(in); THREADED_NEXT();
+op_5xy0: Op5xy0<Q>(in); THREADED_NEXT();
+op_5xy2: Op5xy2<Q>(in); THREADED_NEXT();
+op_5xy3: Op5xy3<Q>(in); THREADED_NEXT();
+op_6xkk: Op6xkk(in); THREADED_NEXT();
+op_7xkk: Op7xkk(in); THREADED_NEXT();
+op_8xy0: Op8xy0(in); THREADED_NEXT();
+op_8xy1: Op8xy1<Q>(in); THREADED_NEXT();
+op_8xy2: Op8xy2<Q>(in); THREADED_NEXT();
+op_8xy3: Op8xy3<Q>(in); THREADED_NEXT();
+op_8xy4: Op8xy4(in); THREADED_NEXT();
+op_8xy5: Op8xy5(in); THREADED_NEXT();
+op_8xy6: Op8xy6<Q>(in); THREADED_NEXT();
+op_8xy7: Op8xy7(in); THREADED_NEXT();
+op_8xye: Op8xyE<Q>(in); THREADED_NEXT();
+op_9xy0: Op9xy0<Q>(in); THREADED_NEXT();
+op_annn: OpAnnn(in); THREADED_NEXT();
+op_bnnn: OpBnnn<Q>(in); THREADED_NEXT();
+op_cxkk: OpCxkk(in); THREADED_NEXT();
+op_dxyn: OpDxyn<Q>(in); THREADED_NEXT();
+op_ex9e: OpEx9E<Q>(in); THREADED_NEXT();
+op_exa1: OpExA1<Q>(in); THREADED_NEXT();
+op_fx07: OpFx07(in); THREADED_NEXT();
+op_fx0a: OpFx0A(in); THREADED_NEXT();
+op_fx15: OpFx15(in); THREADED_NEXT();
+op_fx18: OpFx18(in); THREADED_NEXT();
+op_fx1e: OpFx1E<Q>(in); THREADED_NEXT();
+op_fx29: OpFx29(in); THREADED_NEXT();
+op_fx33: OpFx33(in); THREADED_NEXT();
+op_fx55: OpFx55<Q>(in); THREADED_NEXT();
+op_fx65: OpFx65<Q>(in); THREADED_NEXT();
+op_fx30: OpFx30<Q>(in); THREADED_NEXT();
+op_fx75: OpFx75<Q>(in); THREADED_NEXT();
+op_fx85: OpFx85<Q>(in); THREADED_NEXT();
+op_f000: OpF000<Q>(in); THREADED_NEXT();
+op_fn01: OpFn01<Q>(in); THREADED_NEXT();
+op_f002: OpF002<Q>(in); THREADED_NEXT();
+op_fx3a: OpFx3A<Q>(in); THREADED_NEXT();
+
+#undef THREADED_NEXT
+#else
+    // No labels-as-values: fall back to tail calls through the table.
+    while (count > 0) {
+        StepTable();
+        --count;
+        if (stopHit) break;
+    }
+    return count;
+#endif
+}
+
+void Chip8::DecodeAt(uint16_t addr) {
+    if (decoded.empty()) decoded.resize(CodeSize());
+    // Fused handlers read their operands from the following entries, so
+    // those are decoded too. This is a loop rather than recursion, as a
+    // run of fusable words can be as long as memory.
+    uint32_t end = addr + 2u;
+    for (uint32_t at = addr; at < end; at += 2) {
+        DecodedOp& op = decoded[at];
+        if (at != addr && op.fn) continue;
+        uint16_t opcode = ReadOpcode(at);
+        op.fn = HandlerFor(opcode);
+        op.in = DecodeInstr(opcode);
+        op.fusion = FUSE_NONE;
+        op.fusedLen = 1;
+
+        // decoded[] covers CodeSize(), which under MegaChip is less than
+        // memSize; a sequence must not run past its end.
+        if (at + 6u > CodeSize()) continue;
+        uint8_t a = ids[opcode];
+        uint8_t b = ids[ReadOpcode(at + 2)];
+        uint8_t c = ids[ReadOpcode(at + 4)];
+        if (a == OP_ANNN && b == OP_DXYN) {
+            op.fusion = FUSE_ANNN_DXYN; op.fusedLen = 2;
+        } else if (a == OP_7XKK && b == OP_3XKK && c == OP_1NNN) {
+            op.fusion = FUSE_ADD_SE_JUMP; op.fusedLen = 3;
+        } else if (a == OP_7XKK && b == OP_4XKK && c == OP_1NNN) {
+            op.fusion = FUSE_ADD_SNE_JUMP; op.fusedLen = 3;
+        } else if (a == OP_7XKK && b == OP_1NNN) {
+            op.fusion = FUSE_ADD_JUMP; op.fusedLen = 2;
+        } else if (a == OP_6XKK && b == OP_6XKK && c == OP_6XKK) {
+            op.fusion = FUSE_LOAD3; op.fusedLen = 3;
+        } else if (a == OP_6XKK && b == OP_6XKK) {
+            op.fusion = FUSE_LOAD2; op.fusedLen = 2;
+        }
+        end = std::max(end, at + 2u * op.fusedLen);
+    }
+}
+
+void Chip8::StepPredecoded() {
+    pc &= CodeSize() - 1;
+    if (decoded.empty()) decoded.resize(CodeSize());
+    DecodedOp& op = decoded[pc];
+    if (!op.fn) DecodeAt(pc);
+    pc += 2;
+    op.fn(*this, op.in);
+    // The JIT and AOT engines step through here and read VF directly.
+    SyncFlags();
+}
+
+uint32_t Chip8::RunPredecoded(uint32_t count) {
+    if (decoded.empty()) decoded.resize(CodeSize());
+    while (count > 0) {
+        pc &= CodeSize() - 1;
+        const DecodedOp* op = &decoded[pc];
+        if (!op->fn) DecodeAt(pc);
+        if (op->fusion && fusionEnabled && op->fusedLen <= count) {
+            count -= RunFused(op);
+        } else {
+            pc += 2;
+            op->fn(*this, op->in);
+            --count;
+        }
+        if (stopHit) break;
+    }
+    return count;
+}
+
+// Runs a fused sequence starting at pc; returns the number of guest
+// instructions it stands for (a taken skip jumps over the last one).
+uint32_t Chip8::RunFused(const DecodedOp* op) {
+    const Instr& a = op[0].in;
+    const Instr& b = op[2].in;
+    SyncFlags();
+    switch (op->fusion) {
+        case FUSE_ANNN_DXYN:
+            I = a.nnn;
+            pc += 4;
+            op[2].fn(*this, b);
+            return 2;
+        case FUSE_ADD_SE_JUMP:
+            V[a.x] += a.kk;
+            if (V[b.x] == b.kk) {
+                pc += 6;
+                return 2;
+            }
+            pc = op[4].in.nnn;
+            return 3;
+        case FUSE_ADD_SNE_JUMP:
+            V[a.x] += a.kk;
+            if (V[b.x] != b.kk) {
+                pc += 6;
+                return 2;
+            }
+            pc = op[4].in.nnn;
+            return 3;
+        case FUSE_ADD_JUMP:
+            V[a.x] += a.kk;
+            pc = b.nnn;
+            return 2;
+        case FUSE_LOAD3:
+            V[a.x] = a.kk;
+            V[b.x] = b.kk;
+            V[op[4].in.x] = op[4].in.kk;
+            pc += 6;
+            return 3;
+        case FUSE_LOAD2:
+            V[a.x] = a.kk;
+            V[b.x] = b.kk;
+            pc += 4;
+            return 2;
+    }
+    return 0;
+}
+
+// A store to addr changes the instructions starting at addr and addr - 1,
+// and any fused sequence running through them (up to 6 bytes long).
+constexpr void Chip8::InvalidateDecoded(uint32_t addr, uint32_t len) {
+    // Nothing is cached in constant evaluation.
+    if (std::is_constant_evaluated()) return;
+    if (addr >= CodeSize()) return;
+    if (!decoded.empty()) {
+        uint32_t first = addr > 5 ? addr - 5 : 0;
+        uint32_t last = std::min<uint32_t>(addr + len, CodeSize());
+        for (uint32_t a = first; a < last; ++a) decoded[a].fn = nullptr;
+        if (addr == 0 && CodeSize() == memSize) decoded[memSize - 1].fn = nullptr;
+    }
+    if (blockCache) blockCache->code.Invalidate(addr, len);
+    if (jit) jit->code.Invalidate(addr, len);
+    if (aot) aot->code.Invalidate(addr, len);
+}
+
+// Finishes a store of len bytes written from memory[addr], which may have
+// run into the guard band: moves that part to the bottom of memory and
+// brings the mirror up to date.
+constexpr void Chip8::CommitStore(uint32_t addr, uint32_t len) {
+    InvalidateDecoded(addr, len);
+    int spill = static_cast<int>(addr + len - memSize);
+    if (spill > 0) {
+        std::copy_n(&memory[memSize], spill, memory);
+        InvalidateDecoded(0, spill);
+    }
+    if (spill > 0 || addr < GUARD_SIZE) std::copy_n(memory, GUARD_SIZE, &memory[memSize]);
+}
+
+// Expands the seed with splitmix64, so any seed gives a usable state.
+constexpr void Chip8::SeedRandom(uint64_t seed) {
+    rngSeed = seed;
+    for (uint32_t& word : rng.s) {
+        seed += 0x9E3779B97F4A7C15ull;
+        uint64_t z = seed;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        word = static_cast<uint32_t>((z ^ (z >> 31)) >> 32);
+    }
+}
+
+constexpr uint32_t Chip8::NextRandom() {
+    uint32_t* s = rng.s;
+    uint32_t result = std::rotl(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = std::rotl(s[3], 11);
+    return result;
+}
+
+template <class Q>
+constexpr void Chip8::Opcode0xxx(const Instr& in) {
+    if (in.opcode == 0x00E0) Op00E0(in);
+    else if (in.opcode == 0x00EE) Op00EE(in);
+    else if (!Q::superChip) return;
+    else if (Q::megaChip && (in.opcode & 0xFFFE) == 0x0010) Op001N<Q>(in);
+    else if (Q::megaChip && (in.opcode & 0xFFF0) == 0x00B0) Op00Bn<Q>(in);
+    else if (Q::megaChip && in.x == 0x1) Op01nn<Q>(in);
+    else if (Q::megaChip && in.x >= 0x2 && in.x <= 0x9) Op0xnn<Q>(in);
+    else if ((in.opcode & 0xFFF0) == 0x00C0) Op00Cn<Q>(in);
+    else if (in.opcode == 0x00FB) Op00FB<Q>(in);
+    else if (in.opcode == 0x00FC) Op00FC<Q>(in);
+    else if (in.opcode == 0x00FD) Op00FD<Q>(in);
+    else if (in.opcode == 0x00FE) Op00FE<Q>(in);
+    else if (in.opcode == 0x00FF) Op00FF<Q>(in);
+    else if (Q::xoChip && (in.opcode & 0xFFF0) == 0x00D0) Op00Dn<Q>(in);
+}
+
+template <class Q>
+constexpr void Chip8::Opcode5xxx(const Instr& in) {
+    if (Q::xoChip && in.n == 0x2) Op5xy2<Q>(in);
+    else if (Q::xoChip && in.n == 0x3) Op5xy3<Q>(in);
+    else Op5xy0<Q>(in);
+}
+
+template <class Q>
+constexpr void Chip8::Opcode8xxx(const Instr& in) {
+    switch (in.n) {
+        case 0x0: Op8xy0(in); break;
+        case 0x1: Op8xy1<Q>(in); break;
+        case 0x2: Op8xy2<Q>(in); break;
+        case 0x3: Op8xy3<Q>(in); break;
+        case 0x4: Op8xy4(in); break;
+        case 0x5: Op8xy5(in); break;
+        case 0x6: Op8xy6<Q>(in); break;
+        case 0x7: Op8xy7(in); break;
+        case 0xE: Op8xyE<Q>(in); break;
+    }
+}
+
+template <class Q>
+constexpr void Chip8::OpcodeExxx(const Instr& in) {
+    if (in.kk == 0x9E) OpEx9E<Q>(in);
+    else if (in.kk == 0xA1) OpExA1<Q>(in);
+}
+
+template <class Q>
+constexpr void Chip8::OpcodeFxxx(const Instr& in) {
+    if (Q::xoChip) {
+        if (in.opcode == 0xF000) return OpF000<Q>(in);
+        if (in.opcode == 0xF002) return OpF002<Q>(in);
+        if (in.kk == 0x01) return OpFn01<Q>(in);
+        if (in.kk == 0x3A) return OpFx3A<Q>(in);
+    }
+    switch (in.kk) {
+        case 0x07: OpFx07(in); break;
+        case 0x0A: OpFx0A(in); break;
+        case 0x15: OpFx15(in); break;
+        case 0x18: OpFx18(in); break;
+        case 0x1E: OpFx1E<Q>(in); break;
+        case 0x29: OpFx29(in); break;
+        case 0x33: OpFx33(in); break;
+        case 0x55: OpFx55<Q>(in); break;
+        case 0x65: OpFx65<Q>(in); break;
+        case 0x30: OpFx30<Q>(in); break;
+        case 0x75: OpFx75<Q>(in); break;
+        case 0x85: OpFx85<Q>(in); break;
+    }
+}
+
+constexpr void Chip8::Op00E0(const Instr&) {
+    if (megaOn) std::fill_n(mega->screen, MEGA_WIDTH * MEGA_HEIGHT, 0);
+    ClearPlanes(planeMask);
+    drawFlag = true;
+    stopHit |= stopOn & STOP_DRAW;
+}
+
+// Clears the planes in mask, in both modes' storage.
+constexpr void Chip8::ClearPlanes(uint8_t mask) {
+    for (int p = 0; p < PLANE_COUNT; ++p) {
+        if (!(mask >> p & 1)) continue;
+        std::fill_n(display[p], DISPLAY_HEIGHT, 0);
+        std::fill_n(plane[p], HIRES_HEIGHT * 2, 0);
+    }
+}
+
+// sp counts depth; over- and underflow wrap round the stack as a fault.
+constexpr void Chip8::Op00EE(const Instr&) {
+    faults += sp == 0;
+    pc = stack[--sp & (STACK_SIZE - 1)];
+}
+
+// Shifts a packed plane of one- or two-word rows by dx pixels right and
+// dy rows down (negative for left and up), filling with zeros. Sideways
+// shifts are at most 4, so one word carries into the next.
+static constexpr void ShiftRows(uint64_t* rows, int words, int height, int dx, int dy) {
+    int count = height * words;
+    int shift = dy * words;
+    if (shift > 0) {
+        for (int i = count - 1; i >= 0; --i) rows[i] = i >= shift ? rows[i - shift] : 0;
+    } else if (shift < 0) {
+        for (int i = 0; i < count; ++i) rows[i] = i - shift < count ? rows[i - shift] : 0;
+    }
+    for (int y = 0; dx && y < height; ++y) {
+        uint64_t* row = &rows[y * words];
+        if (dx > 0) {
+            for (int w = words - 1; w > 0; --w) row[w] = row[w] >> dx | row[w - 1] << (64 - dx);
+            row[0] >>= dx;
+        } else {
+            for (int w = 0; w < words - 1; ++w) row[w] = row[w] << -dx | row[w + 1] >> (64 + dx);
+            row[words - 1] <<= -dx;
+        }
+    }
+}
+
+// Scrolls the selected planes in pixels of the current mode.
+constexpr void Chip8::ScrollPlanes(int dx, int dy) {
+    if (megaOn) {
+        ScrollMega(dx, dy);
+        drawFlag = true;
+        stopHit |= stopOn & STOP_DRAW;
+        return;
+    }
+    for (int p = 0; p < PLANE_COUNT; ++p) {
+        if (!(planeMask >> p & 1)) continue;
+        if (hires) ShiftRows(plane[p], 2, HIRES_HEIGHT, dx, dy);
+        else ShiftRows(display[p], 1, DISPLAY_HEIGHT, dx, dy);
+    }
+    drawFlag = true;
+    stopHit |= stopOn & STOP_DRAW;
+}
+
+// SUPER-CHIP scrolls, in pixels of the current mode; in hires they are
+// word moves. XO-CHIP adds 00Dn, and all four act only on the selected
+// planes. Without SUPER-CHIP these are machine-code calls, which are not
+// emulated.
+template <class Q>
+constexpr void Chip8::Op00Cn(const Instr& in) { if (Q::superChip) ScrollPlanes(0, in.n); }
+template <class Q>
+constexpr void Chip8::Op00Dn(const Instr& in) { if (Q::xoChip) ScrollPlanes(0, -in.n); }
+template <class Q>
+constexpr void Chip8::Op00Bn(const Instr& in) { if (Q::megaChip) ScrollPlanes(0, -in.n); }
+template <class Q>
+constexpr void Chip8::Op00FB(const Instr&) { if (Q::superChip) ScrollPlanes(4, 0); }
+template <class Q>
+constexpr void Chip8::Op00FC(const Instr&) { if (Q::superChip) ScrollPlanes(-4, 0); }
+
+// Exit. There is no HP48 to return to, so the machine parks on the
+// instruction, which idle skipping treats like a jump to self.
+template <class Q>
+constexpr void Chip8::Op00FD(const Instr&) {
+    if (Q::superChip) pc -= 2;
+}
+
+template <class Q>
+constexpr void Chip8::Op00FE(const Instr&) { if (Q::superChip) SetHires(false); }
+template <class Q>
+constexpr void Chip8::Op00FF(const Instr&) { if (Q::superChip) SetHires(true); }
+
+// MegaChip. 0011 turns the 256x192 screen on and 0010 back off, both
+// starting from a clear screen.
+template <class Q>
+constexpr void Chip8::Op001N(const Instr& in) {
+    if (!Q::megaChip) return;
+    megaOn = in.n & 1;
+    std::fill_n(mega->screen, MEGA_WIDTH * MEGA_HEIGHT, 0);
+    ClearPlanes((1 << PLANE_COUNT) - 1);
+    drawFlag = true;
+    stopHit |= stopOn & STOP_DRAW;
+}
+
+// 01NN NNNN loads a 24-bit I from NN and the word after it.
+template <class Q>
+constexpr void Chip8::Op01nn(const Instr& in) {
+    if (!Q::megaChip) return;
+    I = (static_cast<uint32_t>(in.kk) << 16 | ReadOpcode(pc)) & INDEX_MASK<Q>;
+    pc += 2;
+}
+
+// The MegaChip registers: 02NN loads NN palette colours, four bytes of
+// ARGB each, from I into entries 1 to NN; 03NN and 04NN set the sprite
+// size, 0 meaning 256; 09NN sets the colour Dxyn reports collisions
+// with. Screen alpha (05NN), digitised sound (060N, 0700) and blend modes
+// (080N) are accepted and ignored.
+template <class Q>
+constexpr void Chip8::Op0xnn(const Instr& in) {
+    if (!Q::megaChip) return;
+    switch (in.x) {
+        case 0x2:
+            for (int c = 0; c < in.kk; ++c) {
+                uint32_t argb = 0;
+                for (int b = 0; b < 4; ++b) argb = argb << 8 | memory[(I + c * 4 + b) & (memSize - 1)];
+                mega->palette[c + 1] = argb;
+            }
+            break;
+        case 0x3: spriteWidth = in.kk ? in.kk : 256; break;
+        case 0x4: spriteHeight = in.kk ? in.kk : 256; break;
+        case 0x9: collisionColor = in.kk; break;
+        default: break;
+    }
+}
+
+// Switching mode clears every plane, as Octo and XO-CHIP do.
+constexpr void Chip8::SetHires(bool on) {
+    hires = on;
+    ClearPlanes((1 << PLANE_COUNT) - 1);
+    drawFlag = true;
+    stopHit |= stopOn & STOP_DRAW;
+}
+constexpr void Chip8::Op1nnn(const Instr& in) { pc = in.nnn; }
+constexpr void Chip8::Op2nnn(const Instr& in) {
+    faults += sp >= STACK_SIZE;
+    stack[sp++ & (STACK_SIZE - 1)] = pc;
+    pc = in.nnn;
+}
+// Under XO-CHIP the instruction skipped may be the four-byte F000 NNNN.
+template <class Q>
+constexpr void Chip8::Skip() { pc += Q::xoChip && ReadOpcode(pc) == 0xF000 ? 4 : 2; }
+template <class Q>
+constexpr void Chip8::Op3xkk(const Instr& in) { if (V[in.x] == in.kk) Skip<Q>(); }
+template <class Q>
+constexpr void Chip8::Op4xkk(const Instr& in) { if (V[in.x] != in.kk) Skip<Q>(); }
+template <class Q>
+constexpr void Chip8::Op5xy0(const Instr& in) { if (V[in.x] == V[in.y]) Skip<Q>(); }
+
+// XO-CHIP register ranges: Vx..Vy to or from memory at I, in either
+// direction, leaving I alone.
+template <class Q>
+constexpr void Chip8::Op5xy2(const Instr& in) {
+    int len = (in.x > in.y ? in.x - in.y : in.y - in.x) + 1;
+    int step = in.x > in.y ? -1 : 1;
+    uint8_t* p = GuestSpan(len);
+    for (int i = 0; i < len; ++i) p[i] = V[in.x + i * step];
+    CommitStore(I & (memSize - 1), len);
+}
+template <class Q>
+constexpr void Chip8::Op5xy3(const Instr& in) {
+    int len = (in.x > in.y ? in.x - in.y : in.y - in.x) + 1;
+    int step = in.x > in.y ? -1 : 1;
+    const uint8_t* p = GuestSpan(len);
+    for (int i = 0; i < len; ++i) V[in.x + i * step] = p[i];
+}
+constexpr void Chip8::Op6xkk(const Instr& in) { V[in.x] = in.kk; }
+constexpr void Chip8::Op7xkk(const Instr& in) { V[in.x] += in.kk; }
+constexpr void Chip8::OpAnnn(const Instr& in) { I = in.nnn; }
+template <class Q>
+constexpr void Chip8::OpBnnn(const Instr& in) { pc = in.nnn + V[Q::jumpVx ? in.x : 0]; }
+constexpr void Chip8::OpCxkk(const Instr& in) { V[in.x] = (NextRandom() >> 24) & in.kk; }
+
+constexpr void Chip8::Op8xy0(const Instr& in) { V[in.x] = V[in.y]; }
+
+template <class Q>
+constexpr void Chip8::Op8xy1(const Instr& in) {
+    V[in.x] |= V[in.y];
+    if (Q::vfReset) V[0xF] = 0;
+}
+
+template <class Q>
+constexpr void Chip8::Op8xy2(const Instr& in) {
+    V[in.x] &= V[in.y];
+    if (Q::vfReset) V[0xF] = 0;
+}
+
+template <class Q>
+constexpr void Chip8::Op8xy3(const Instr& in) {
+    V[in.x] ^= V[in.y];
+    if (Q::vfReset) V[0xF] = 0;
+}
+
+constexpr void Chip8::Op8xy4(const Instr& in) {
+    uint16_t sum = V[in.x] + V[in.y];
+    V[0xF] = (sum > 0xFF) ? 1 : 0;
+    V[in.x] = sum & 0xFF;
+}
+
+constexpr void Chip8::Op8xy5(const Instr& in) {
+    V[0xF] = (V[in.x] > V[in.y]) ? 1 : 0;
+    V[in.x] -= V[in.y];
+}
+
+template <class Q>
+constexpr void Chip8::Op8xy6(const Instr& in) {
+    uint8_t src = Q::shiftVx ? in.x : in.y;
+    V[0xF] = V[src] & 0x01;
+    V[in.x] = V[src] >> 1;
+}
+
+constexpr void Chip8::Op8xy7(const Instr& in) {
+    V[0xF] = (V[in.y] > V[in.x]) ? 1 : 0;
+    V[in.x] = V[in.y] - V[in.x];
+}
+
+template <class Q>
+constexpr void Chip8::Op8xyE(const Instr& in) {
+    uint8_t src = Q::shiftVx ? in.x : in.y;
+    V[0xF] = (V[src] & 0x80) >> 7;
+    V[in.x] = V[src] << 1;
+}
+
+// ----------------------------------------------------------------------
+// SIMD kernels
+// ----------------------------------------------------------------------
+// Pixel loops come in scalar, SSE2, AVX2 and AVX-512 forms. One binary
+// runs on every x86-64, so the wider ones are built with target
+// attributes and picked once at startup from CPUID; --simd forces one.
+// The rest of the program is SSE code, so the wide kernels clear the
+// upper register halves before returning or calling out.
+
+// Copies a row of palette indices over the screen, index 0 leaving the
+// screen pixel as it was, and reports whether an opaque pixel landed on
+// the collision colour.
+static constexpr bool BlitIndexedRowScalar(uint8_t* dst, const uint8_t* src, int width, uint8_t key) {
+    bool hit = false;
+    for (int x = 0; x < width; ++x) {
+        if (!src[x]) continue;
+        hit |= dst[x] == key;
+        dst[x] = src[x];
+    }
+    return hit;
+}
+
+// Expands pixels of two planes, pixel 0 in bit 63 of the first word, into
+// one colour index byte per pixel.
+static void ExpandRowScalar(const uint64_t* plane0, const uint64_t* plane1, int words, uint8_t* out) {
+    for (int i = 0; i < words * 64; ++i) {
+        int shift = 63 - (i & 63);
+        out[i] = (plane0[i >> 6] >> shift & 1) | (plane1[i >> 6] >> shift & 1) << 1;
+    }
+}
+
+#if defined(__SSE2__)
+// Sixteen pixels a step with a compare-and-select instead of a branch
+// per pixel.
+static bool BlitIndexedRowSse2(uint8_t* dst, const uint8_t* src, int width, uint8_t key) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i match = _mm_set1_epi8(static_cast<char>(key));
+    __m128i hits = zero;
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + x));
+        __m128i clear = _mm_cmpeq_epi8(s, zero);
+        hits = _mm_or_si128(hits, _mm_andnot_si128(clear, _mm_cmpeq_epi8(d, match)));
+        __m128i out = _mm_or_si128(_mm_and_si128(clear, d), _mm_andnot_si128(clear, s));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), out);
+    }
+    bool hit = _mm_movemask_epi8(hits) != 0;
+    return BlitIndexedRowScalar(dst + x, src + x, width - x, key) || hit;
+}
+
+// A hires row is one register.
+static bool BlitRowSse2(uint64_t* row, uint64_t m0, uint64_t m1) {
+    __m128i* p = reinterpret_cast<__m128i*>(row);
+    __m128i r = _mm_load_si128(p);
+    __m128i m = _mm_set_epi64x(static_cast<long long>(m1), static_cast<long long>(m0));
+    _mm_store_si128(p, _mm_xor_si128(r, m));
+    __m128i hit = _mm_cmpeq_epi8(_mm_and_si128(r, m), _mm_setzero_si128());
+    return _mm_movemask_epi8(hit) != 0xFFFF;
+}
+
+// Broadcasts each half of sixteen pixels into eight byte lanes and tests
+// one bit per lane.
+static void ExpandRowSse2(const uint64_t* plane0, const uint64_t* plane1, int words, uint8_t* out) {
+    const uint64_t spread = 0x0101010101010101ull;
+    const __m128i select = _mm_set1_epi64x(0x0102040810204080ll);
+    for (int i = 0; i < words * 4; ++i, out += 16) {
+        int shift = 48 - (i & 3) * 16;
+        uint64_t bits0 = plane0[i >> 2] >> shift & 0xFFFF;
+        uint64_t bits1 = plane1[i >> 2] >> shift & 0xFFFF;
+        __m128i p0 = _mm_set_epi64x(static_cast<long long>((bits0 & 0xFF) * spread),
+                                    static_cast<long long>((bits0 >> 8) * spread));
+        __m128i p1 = _mm_set_epi64x(static_cast<long long>((bits1 & 0xFF) * spread),
+                                    static_cast<long long>((bits1 >> 8) * spread));
+        p0 = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(p0, select), select), _mm_set1_epi8(1));
+        p1 = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(p1, select), select), _mm_set1_epi8(2));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_or_si128(p0, p1));
+    }
+}
+#endif
+
+#if CHIP8_HAVE_AVX
+// Byte lane i of a row expansion reads byte 7 - i / 8 of a word: pixel 0
+// is the top bit of the top byte. Shuffles stay within 128-bit lanes, and
+// every lane holds the whole word, so the indices repeat per lane.
+alignas(64) static const uint8_t EXPAND_ORDER[64] = {
+    7, 7, 7, 7, 7, 7, 7, 7, 6, 6, 6, 6, 6, 6, 6, 6, 5, 5, 5, 5, 5, 5, 5, 5, 4, 4, 4, 4, 4, 4, 4, 4,
+    3, 3, 3, 3, 3, 3, 3, 3, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+__attribute__((target("avx2")))
+static bool BlitIndexedRowAvx2(uint8_t* dst, const uint8_t* src, int width, uint8_t key) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i match = _mm256_set1_epi8(static_cast<char>(key));
+    __m256i hits = zero;
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + x));
+        __m256i clear = _mm256_cmpeq_epi8(s, zero);
+        hits = _mm256_or_si256(hits, _mm256_andnot_si256(clear, _mm256_cmpeq_epi8(d, match)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), _mm256_blendv_epi8(s, d, clear));
+    }
+    if (x + 16 <= width) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + x));
+        __m128i clear = _mm_cmpeq_epi8(s, _mm_setzero_si128());
+        __m128i hit = _mm_andnot_si128(clear, _mm_cmpeq_epi8(d, _mm256_castsi256_si128(match)));
+        hits = _mm256_or_si256(hits, _mm256_zextsi128_si256(hit));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_blendv_epi8(s, d, clear));
+        x += 16;
+    }
+    bool hit = !_mm256_testz_si256(hits, hits);
+    _mm256_zeroupper();
+    return BlitIndexedRowScalar(dst + x, src + x, width - x, key) || hit;
+}
+
+// Thirty-two pixels a step: the word is broadcast, each byte lane picks
+// its byte and tests its bit.
+__attribute__((target("avx2")))
+static void ExpandRowAvx2(const uint64_t* plane0, const uint64_t* plane1, int words, uint8_t* out) {
+    const __m256i select = _mm256_set1_epi64x(0x0102040810204080ll);
+    const __m256i ones = _mm256_set1_epi8(1);
+    for (int w = 0; w < words; ++w) {
+        __m256i v0 = _mm256_set1_epi64x(static_cast<long long>(plane0[w]));
+        __m256i v1 = _mm256_set1_epi64x(static_cast<long long>(plane1[w]));
+        for (int half = 0; half < 2; ++half, out += 32) {
+            __m256i order = _mm256_load_si256(reinterpret_cast<const __m256i*>(EXPAND_ORDER + half * 32));
+            __m256i b0 = _mm256_and_si256(_mm256_shuffle_epi8(v0, order), select);
+            __m256i b1 = _mm256_and_si256(_mm256_shuffle_epi8(v1, order), select);
+            __m256i p0 = _mm256_and_si256(_mm256_cmpeq_epi8(b0, select), ones);
+            __m256i p1 = _mm256_and_si256(_mm256_cmpeq_epi8(b1, select), _mm256_add_epi8(ones, ones));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_or_si256(p0, p1));
+        }
+    }
+    _mm256_zeroupper();
+}
+
+// Masked loads and stores take the ragged end too, so there is no scalar
+// tail.
+__attribute__((target("avx512f,avx512bw")))
+static bool BlitIndexedRowAvx512(uint8_t* dst, const uint8_t* src, int width, uint8_t key) {
+    const __m512i match = _mm512_set1_epi8(static_cast<char>(key));
+    __mmask64 hits = 0;
+    for (int x = 0; x < width; x += 64) {
+        __mmask64 live = width - x >= 64 ? ~0ull : (1ull << (width - x)) - 1;
+        __m512i s = _mm512_maskz_loadu_epi8(live, src + x);
+        __m512i d = _mm512_maskz_loadu_epi8(live, dst + x);
+        __mmask64 opaque = _mm512_test_epi8_mask(s, s);
+        hits |= opaque & _mm512_cmpeq_epi8_mask(d, match);
+        _mm512_mask_storeu_epi8(dst + x, opaque, s);
+    }
+    _mm256_zeroupper();
+    return hits != 0;
+}
+
+// A whole word of pixels a step, the bit tests going straight to masks.
+__attribute__((target("avx512f,avx512bw")))
+static void ExpandRowAvx512(const uint64_t* plane0, const uint64_t* plane1, int words, uint8_t* out) {
+    const __m512i order = _mm512_load_si512(EXPAND_ORDER);
+    const __m512i select = _mm512_set1_epi64(0x0102040810204080ll);
+    const __m512i one = _mm512_set1_epi8(1);
+    const __m512i two = _mm512_set1_epi8(2);
+    for (int w = 0; w < words; ++w, out += 64) {
+        __m512i v0 = _mm512_shuffle_epi8(_mm512_set1_epi64(static_cast<long long>(plane0[w])), order);
+        __m512i v1 = _mm512_shuffle_epi8(_mm512_set1_epi64(static_cast<long long>(plane1[w])), order);
+        __m512i px = _mm512_maskz_mov_epi8(_mm512_test_epi8_mask(v0, select), one);
+        px = _mm512_mask_add_epi8(px, _mm512_test_epi8_mask(v1, select), px, two);
+        _mm512_storeu_si512(out, px);
+    }
+    _mm256_zeroupper();
+}
+#endif
+
+enum class Simd : uint8_t { Scalar, Sse2, Avx2, Avx512 };
+
+static const char* SimdName(Simd level) {
+    switch (level) {
+        case Simd::Scalar: return "scalar";
+        case Simd::Sse2:   return "sse2";
+        case Simd::Avx2:   return "avx2";
+        case Simd::Avx512: return "avx512";
+    }
+    return "unknown";
+}
+
+static bool ParseSimd(const std::string& name, Simd& level) {
+    if (name == "scalar") { level = Simd::Scalar; return true; }
+    if (name == "sse2")   { level = Simd::Sse2;   return true; }
+    if (name == "avx2")   { level = Simd::Avx2;   return true; }
+    if (name == "avx512") { level = Simd::Avx512; return true; }
+    return false;
+}
+
+// The widest level this CPU and OS can run. __builtin_cpu_supports also
+// checks that the OS saves the wider registers.
+static Simd DetectSimd() {
+#if CHIP8_HAVE_AVX
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return Simd::Avx512;
+    if (__builtin_cpu_supports("avx2")) return Simd::Avx2;
+#endif
+#if defined(__SSE2__)
+    return Simd::Sse2;
+#else
+    return Simd::Scalar;
+#endif
+}
+
+struct SimdKernels {
+    Simd level;
+    bool (*blitIndexedRow)(uint8_t* dst, const uint8_t* src, int width, uint8_t key);
+    void (*expandRow)(const uint64_t* plane0, const uint64_t* plane1, int words, uint8_t* out);
+};
+
+static SimdKernels KernelsFor(Simd level) {
+    switch (level) {
+#if CHIP8_HAVE_AVX
+        case Simd::Avx512: return {level, BlitIndexedRowAvx512, ExpandRowAvx512};
+        case Simd::Avx2:   return {level, BlitIndexedRowAvx2, ExpandRowAvx2};
+#endif
+#if defined(__SSE2__)
+        case Simd::Sse2:   return {level, BlitIndexedRowSse2, ExpandRowSse2};
+#endif
+        default:           return {Simd::Scalar, BlitIndexedRowScalar, ExpandRowScalar};
+    }
+}
+
+static SimdKernels simd = KernelsFor(DetectSimd());
+
+// Fails, leaving the current kernels, when the CPU cannot run level.
+static bool SetSimd(Simd level) {
+    if (level > DetectSimd()) return false;
+    simd = KernelsFor(level);
+    return true;
+}
+
+// ----------------------------------------------------------------------
+// Lazy VF flags
+// ----------------------------------------------------------------------
+// Most ROMs overwrite VF long before reading it. In lazy mode the decoded
+// engines run 8xy4..8xyE (when neither operand is VF) as forms that only
+// record the operands; anything else that touches VF settles it first,
+// and every batch ends settled, so nothing outside sees the difference.
+enum FlagKind : uint8_t { FLAG_NONE, FLAG_ADD, FLAG_SUB, FLAG_SHR, FLAG_SUBN, FLAG_SHL };
+
+static constexpr uint32_t PackFlag(FlagKind kind, uint8_t a, uint8_t b) {
+    return static_cast<uint32_t>(kind) << 16 | a << 8 | b;
+}
+
+constexpr void Chip8::Op8xy4Lazy(const Instr& in) {
+    pendingFlag = PackFlag(FLAG_ADD, V[in.x], V[in.y]);
+    V[in.x] += V[in.y];
+}
+
+constexpr void Chip8::Op8xy5Lazy(const Instr& in) {
+    pendingFlag = PackFlag(FLAG_SUB, V[in.x], V[in.y]);
+    V[in.x] -= V[in.y];
+}
+
+template <class Q>
+constexpr void Chip8::Op8xy6Lazy(const Instr& in) {
+    uint8_t src = V[Q::shiftVx ? in.x : in.y];
+    pendingFlag = PackFlag(FLAG_SHR, 0, src);
+    V[in.x] = src >> 1;
+}
+
+constexpr void Chip8::Op8xy7Lazy(const Instr& in) {
+    pendingFlag = PackFlag(FLAG_SUBN, V[in.x], V[in.y]);
+    V[in.x] = V[in.y] - V[in.x];
+}
+
+template <class Q>
+constexpr void Chip8::Op8xyELazy(const Instr& in) {
+    uint8_t src = V[Q::shiftVx ? in.x : in.y];
+    pendingFlag = PackFlag(FLAG_SHL, 0, src);
+    V[in.x] = src << 1;
+}
+
+constexpr void Chip8::MaterializeFlag() {
+    uint8_t a = pendingFlag >> 8;
+    uint8_t b = pendingFlag;
+    switch (pendingFlag >> 16) {
+        case FLAG_ADD:  V[0xF] = a + b > 0xFF; break;
+        case FLAG_SUB:  V[0xF] = a > b; break;
+        case FLAG_SHR:  V[0xF] = b & 0x01; break;
+        case FLAG_SUBN: V[0xF] = b > a; break;
+        case FLAG_SHL:  V[0xF] = b >> 7; break;
+    }
+    pendingFlag = 0;
+}
+
+void Chip8::SyncedOp(Chip8& chip8, const Instr& in) {
+    chip8.SyncFlags();
+    chip8.handlers[in.opcode](chip8, in);
+}
+
+static bool TouchesVF(uint8_t id, const Instr& in, const QuirkFlags& quirks) {
+    switch (id) {
+        case OP_NOP: case OP_00E0: case OP_00EE: case OP_1NNN: case OP_2NNN:
+        case OP_ANNN:
+            return false;
+        case OP_BNNN:
+            return quirks.jumpVx && in.x == 0xF;
+        case OP_8XY1: case OP_8XY2: case OP_8XY3:
+            if (quirks.vfReset) return true;
+            return in.x == 0xF || in.y == 0xF;
+        case OP_5XY0: case OP_9XY0: case OP_8XY0:
+            return in.x == 0xF || in.y == 0xF;
+        case OP_5XY2: case OP_5XY3:
+            return true;
+        case OP_8XY4: case OP_8XY5: case OP_8XY6: case OP_8XY7: case OP_8XYE:
+        case OP_DXYN:
+            return true;
+        default:
+            return in.x == 0xF;
+    }
+}
+
+// Handler the decoded engines install for opcode.
+Chip8::OpFn Chip8::HandlerFor(uint16_t opcode) const {
+    if (!lazyFlags) return handlers[opcode];
+    uint8_t id = ids[opcode];
+    Instr in = DecodeInstr(opcode);
+    if (in.x != 0xF && in.y != 0xF) {
+        switch (id) {
+            case OP_8XY4: return &Thunk<&Chip8::Op8xy4Lazy>;
+            case OP_8XY5: return &Thunk<&Chip8::Op8xy5Lazy>;
+            case OP_8XY7: return &Thunk<&Chip8::Op8xy7Lazy>;
+            case OP_8XY6:
+                return WithQuirks(quirks, [](auto q) -> OpFn {
+                    return &Thunk<&Chip8::Op8xy6Lazy<decltype(q)>>;
+                });
+            case OP_8XYE:
+                return WithQuirks(quirks, [](auto q) -> OpFn {
+                    return &Thunk<&Chip8::Op8xyELazy<decltype(q)>>;
+                });
+            default: break;
+        }
+    }
+    return TouchesVF(id, in, FlagsOf(quirks)) ? &SyncedOp : handlers[opcode];
+}
+
+void Chip8::SetLazyFlags(bool enabled) {
+    SyncFlags();
+    lazyFlags = enabled;
+    // Decoded ops baked in the other handler set.
+    decoded.clear();
+    blockCache.reset();
+}
+
+// ----------------------------------------------------------------------
+// IR translation
+// ----------------------------------------------------------------------
+// The tables are not there in constant evaluation.
+constexpr uint8_t Chip8::IdOf(uint16_t opcode) const {
+    if (std::is_constant_evaluated()) {
+        return WithQuirks(quirks, [opcode](auto q) -> uint8_t {
+            return ClassifyOpcode<decltype(q)>(opcode);
+        });
+    }
+    return ids[opcode];
+}
+
+constexpr std::vector<IrOp> Chip8::TranslateIr(uint16_t addr, const uint8_t* leaders) const {
+    std::vector<IrOp> ops;
+    uint32_t a = addr;
+    while (a + 1u < CodeSize() && ops.size() < MAX_BLOCK_OPS) {
+        uint16_t opcode = ReadOpcode(a);
+        uint8_t id = IdOf(opcode);
+        ops.push_back({static_cast<uint16_t>(a), id, 0, DecodeInstr(opcode)});
+        a += 2;
+        if (EndsBlock(id) || (leaders && a < CodeSize() && leaders[a])) break;
+    }
+    return ops;
+}
+
+// As the block engine runs ops, one handler each with pc past the op.
+constexpr void Chip8::RunIr(const std::vector<IrOp>& ops) {
+    WithQuirks(quirks, [&](auto q) {
+        using Q = decltype(q);
+        for (const IrOp& op : ops) {
+            pc = op.addr + 2;
+            if (op.flags & IR_DEAD) continue;
+            if (!(op.flags & IR_NO_VF)) {
+                ExecuteSwitch<Q>(op.in);
+                continue;
+            }
+            switch (op.id) {
+                case OP_8XY1: Op8xyNoVF<OP_8XY1, Q>(op.in); break;
+                case OP_8XY2: Op8xyNoVF<OP_8XY2, Q>(op.in); break;
+                case OP_8XY3: Op8xyNoVF<OP_8XY3, Q>(op.in); break;
+                case OP_8XY4: Op8xyNoVF<OP_8XY4, Q>(op.in); break;
+                case OP_8XY5: Op8xyNoVF<OP_8XY5, Q>(op.in); break;
+                case OP_8XY6: Op8xyNoVF<OP_8XY6, Q>(op.in); break;
+                case OP_8XY7: Op8xyNoVF<OP_8XY7, Q>(op.in); break;
+                case OP_8XYE: Op8xyNoVF<OP_8XYE, Q>(op.in); break;
+            }
+        }
+    });
+}
+
+// 8xy1..8xyE with the VF write left out.
+template <uint8_t Id, class Q>
+constexpr void Chip8::Op8xyNoVF(const Instr& in) {
+    uint8_t src = V[Q::shiftVx ? in.x : in.y];
+    switch (Id) {
+        case OP_8XY1: V[in.x] |= V[in.y]; break;
+        case OP_8XY2: V[in.x] &= V[in.y]; break;
+        case OP_8XY3: V[in.x] ^= V[in.y]; break;
+        case OP_8XY4: V[in.x] += V[in.y]; break;
+        case OP_8XY5: V[in.x] -= V[in.y]; break;
+        case OP_8XY6: V[in.x] = src >> 1; break;
+        case OP_8XY7: V[in.x] = V[in.y] - V[in.x]; break;
+        case OP_8XYE: V[in.x] = src << 1; break;
+    }
+}
+
+// Handler the block engine installs for op. Rewritten ops are ordinary
+// opcodes, so only IR_NO_VF needs forms of its own.
+Chip8::OpFn Chip8::IrHandler(const IrOp& op) const {
+    if (!(op.flags & IR_NO_VF)) return HandlerFor(op.in.opcode);
+    return WithQuirks(quirks, [&](auto q) -> OpFn {
+        using Q = decltype(q);
+        switch (op.id) {
+            case OP_8XY1: return &Thunk<&Chip8::Op8xyNoVF<OP_8XY1, Q>>;
+            case OP_8XY2: return &Thunk<&Chip8::Op8xyNoVF<OP_8XY2, Q>>;
+            case OP_8XY3: return &Thunk<&Chip8::Op8xyNoVF<OP_8XY3, Q>>;
+            case OP_8XY4: return &Thunk<&Chip8::Op8xyNoVF<OP_8XY4, Q>>;
+            case OP_8XY5: return &Thunk<&Chip8::Op8xyNoVF<OP_8XY5, Q>>;
+            case OP_8XY6: return &Thunk<&Chip8::Op8xyNoVF<OP_8XY6, Q>>;
+            case OP_8XY7: return &Thunk<&Chip8::Op8xyNoVF<OP_8XY7, Q>>;
+            default:      return &Thunk<&Chip8::Op8xyNoVF<OP_8XYE, Q>>;
+        }
+    });
+}
+
+template <class Q>
+constexpr void Chip8::Op9xy0(const Instr& in) {
+    if (V[in.x] != V[in.y]) Skip<Q>();
+}
+
+// Under SUPER-CHIP Dxy0 draws a 16x16 sprite, two bytes a row, in
+// either mode. XO-CHIP draws into each selected plane in turn, the
+// sprite data for plane 1 following plane 0's.
+template <class Q>
+constexpr void Chip8::OpDxyn(const Instr& in) {
+    if (Q::megaChip && megaOn) {
+        V[0xF] = DrawMega(V[in.x], V[in.y]);
+        drawFlag = true;
+        stopHit |= stopOn & STOP_DRAW;
+        return;
+    }
+    bool wide = Q::superChip && in.n == 0;
+    int rows = wide ? 16 : in.n;
+    int bytes = wide ? 32 : in.n;
+    uint8_t x = V[in.x];
+    uint8_t y = V[in.y];
+    const uint8_t* sprite = GuestSpan(bytes * std::popcount(planeMask));
+    bool hit = false;
+
+    for (int p = 0; p < PLANE_COUNT; ++p) {
+        if (!(planeMask >> p & 1)) continue;
+        if (Q::superChip && hires) hit |= DrawHires<Q>(plane[p], sprite, x, y, rows, wide);
+        else hit |= DrawLores<Q>(display[p], sprite, x, y, rows, wide);
+        sprite += bytes;
+    }
+    V[0xF] = hit;
+    drawFlag = true;
+    stopHit |= stopOn & STOP_DRAW;
+}
+
+// Sprite row r of a 8- or 16-pixel sprite with pixel 0 in bit 63.
+static constexpr uint64_t SpriteRow(const uint8_t* sprite, int r, bool wide) {
+    return wide ? static_cast<uint64_t>(sprite[r * 2] << 8 | sprite[r * 2 + 1]) << 48
+                : static_cast<uint64_t>(sprite[r]) << 56;
+}
+
+// A lores row is one word, so a sprite row is one shift, with the part
+// past the right edge rotated round or dropped, one AND for the collision
+// and one XOR.
+template <class Q>
+constexpr bool Chip8::DrawLores(uint64_t* rows, const uint8_t* sprite, int x, int y, int count,
+                                bool wide) {
+    x %= DISPLAY_WIDTH;
+    y %= DISPLAY_HEIGHT;
+    bool hit = false;
+    for (int row = 0; row < count; ++row) {
+        if (!Q::wrapSprites && y + row >= DISPLAY_HEIGHT) break;
+        uint64_t bits = SpriteRow(sprite, row, wide);
+        uint64_t mask = Q::wrapSprites ? std::rotr(bits, x) : bits >> x;
+        uint64_t& dst = rows[(y + row) % DISPLAY_HEIGHT];
+        hit |= (dst & mask) != 0;
+        dst ^= mask;
+    }
+    return hit;
+}
+
+// Rows narrower than an SSE2 register are not worth the indirect call.
+static constexpr bool BlitIndexedRow(uint8_t* dst, const uint8_t* src, int width, uint8_t key) {
+    if (std::is_constant_evaluated() || width < 16) return BlitIndexedRowScalar(dst, src, width, key);
+    return simd.blitIndexedRow(dst, src, width, key);
+}
+
+// MegaChip sprites are spriteWidth x spriteHeight palette indices, a byte
+// a pixel, clipped at the screen edges.
+bool Chip8::DrawMega(int x, int y) {
+    y %= MEGA_HEIGHT;
+    uint32_t base = I & (memSize - 1);
+    faults += I + spriteWidth * spriteHeight > memSize;
+    int rows = std::min<int>(spriteHeight, MEGA_HEIGHT - y);
+    int cols = std::min<int>(spriteWidth, MEGA_WIDTH - x);
+    bool hit = false;
+    for (int r = 0; r < rows; ++r) {
+        // A row that runs off the end of memory carries on from 0.
+        uint8_t* dst = &mega->screen[(y + r) * MEGA_WIDTH + x];
+        uint32_t from = (base + r * spriteWidth) & (memSize - 1);
+        int first = static_cast<int>(std::min<uint32_t>(cols, memSize - from));
+        hit |= BlitIndexedRow(dst, &memory[from], first, collisionColor);
+        if (first < cols) hit |= BlitIndexedRow(dst + first, memory, cols - first, collisionColor);
+    }
+    return hit;
+}
+
+// Scrolls the MegaChip screen dx pixels right and dy down, or left and up
+// for negative values, filling with index 0.
+void Chip8::ScrollMega(int dx, int dy) {
+    uint8_t* screen = mega->screen;
+    if (dy > 0) {
+        std::memmove(screen + dy * MEGA_WIDTH, screen, (MEGA_HEIGHT - dy) * MEGA_WIDTH);
+        std::memset(screen, 0, dy * MEGA_WIDTH);
+    } else if (dy < 0) {
+        std::memmove(screen, screen - dy * MEGA_WIDTH, (MEGA_HEIGHT + dy) * MEGA_WIDTH);
+        std::memset(screen + (MEGA_HEIGHT + dy) * MEGA_WIDTH, 0, -dy * MEGA_WIDTH);
+    }
+    for (int y = 0; dx && y < MEGA_HEIGHT; ++y) {
+        uint8_t* row = &screen[y * MEGA_WIDTH];
+        if (dx > 0) {
+            std::memmove(row + dx, row, MEGA_WIDTH - dx);
+            std::memset(row, 0, dx);
+        } else {
+            std::memmove(row, row - dx, MEGA_WIDTH + dx);
+            std::memset(row + MEGA_WIDTH + dx, 0, -dx);
+        }
+    }
+}
+
+// XORs one 128-bit mask into a hires row, two words, and reports whether
+// it turned any pixel off. The row fits one SSE2 register, so wider
+// levels have nothing to add, and a branch is cheaper than a call here.
+static constexpr bool BlitRow(uint64_t* row, uint64_t m0, uint64_t m1) {
+#if defined(__SSE2__)
+    if (!std::is_constant_evaluated() && simd.level != Simd::Scalar) return BlitRowSse2(row, m0, m1);
+#endif
+    bool hit = (row[0] & m0) | (row[1] & m1);
+    row[0] ^= m0;
+    row[1] ^= m1;
+    return hit;
+}
+
+// Each sprite row is shifted into a 128-bit mask at x, the part past the
+// right edge wrapping to the left or dropped, and blitted in one go.
+template <class Q>
+constexpr bool Chip8::DrawHires(uint64_t* rows, const uint8_t* sprite, int x, int y, int count, bool wide) {
+    x %= HIRES_WIDTH;
+    y %= HIRES_HEIGHT;
+    bool hit = false;
+
+    for (int row = 0; row < count; ++row) {
+        if (!Q::wrapSprites && y + row >= HIRES_HEIGHT) break;
+        uint64_t bits = SpriteRow(sprite, row, wide);
+        uint64_t m0, m1;
+        if (x < 64) {
+            m0 = bits >> x;
+            m1 = x ? bits << (64 - x) : 0;
+        } else {
+            m1 = bits >> (x - 64);
+            m0 = Q::wrapSprites && x > 64 ? bits << (128 - x) : 0;
+        }
+        hit |= BlitRow(&rows[(y + row) % HIRES_HEIGHT * 2], m0, m1);
+    }
+    return hit;
+}
+
+constexpr bool Chip8::KeyDown(uint8_t key) {
+    faults += key > 0xF;
+    return keypad[key & 0xF];
+}
+template <class Q>
+constexpr void Chip8::OpEx9E(const Instr& in) { if (KeyDown(V[in.x])) Skip<Q>(); }
+template <class Q>
+constexpr void Chip8::OpExA1(const Instr& in) { if (!KeyDown(V[in.x])) Skip<Q>(); }
+
+constexpr void Chip8::OpFx07(const Instr& in) { V[in.x] = delay_timer; }
+
+// Halts until SetKey() sees a key pressed and released, as the VIP does.
+constexpr void Chip8::OpFx0A(const Instr& in) {
+    halted = true;
+    haltReg = in.x;
+    haltKey = -1;
+    stopHit |= STOP_HALT | (stopOn & STOP_KEY_WAIT);
+}
+
+constexpr void Chip8::OpFx15(const Instr& in) { delay_timer = V[in.x]; }
+constexpr void Chip8::OpFx18(const Instr& in) {
+    if ((sound_timer > 0) != (V[in.x] > 0)) stopHit |= stopOn & STOP_SOUND;
+    sound_timer = V[in.x];
+}
+template <class Q>
+constexpr void Chip8::OpFx1E(const Instr& in) { I = (I + V[in.x]) & INDEX_MASK<Q>; }
+constexpr void Chip8::OpFx29(const Instr& in) { I = FONTSET_ADDR + (V[in.x] * 5); }
+
+constexpr void Chip8::OpFx33(const Instr& in) {
+    uint8_t* p = GuestSpan(3);
+    p[0] = V[in.x] / 100;
+    p[1] = (V[in.x] / 10) % 10;
+    p[2] = V[in.x] % 10;
+    CommitStore(I & (memSize - 1), 3);
+}
+
+template <class Q>
+constexpr void Chip8::OpFx55(const Instr& in) {
+    uint8_t* p = GuestSpan(in.x + 1);
+    for (int i = 0; i <= in.x; ++i) p[i] = V[i];
+    CommitStore(I & (memSize - 1), in.x + 1);
+    if (Q::incrementI) I = (I + in.x + 1) & INDEX_MASK<Q>;
+}
+
+template <class Q>
+constexpr void Chip8::OpFx65(const Instr& in) {
+    const uint8_t* p = GuestSpan(in.x + 1);
+    for (int i = 0; i <= in.x; ++i) V[i] = p[i];
+    if (Q::incrementI) I = (I + in.x + 1) & INDEX_MASK<Q>;
+}
+
+template <class Q>
+constexpr void Chip8::OpFx30(const Instr& in) {
+    if (Q::superChip) I = BIGFONT_ADDR + (V[in.x] & 0xF) * 10;
+}
+
+// The HP48's RPL user flags, which SUPER-CHIP games use as a save area.
+template <class Q>
+constexpr void Chip8::OpFx75(const Instr& in) {
+    if (Q::superChip) std::copy_n(V, in.x + 1, rpl);
+}
+template <class Q>
+constexpr void Chip8::OpFx85(const Instr& in) {
+    if (Q::superChip) std::copy_n(rpl, in.x + 1, V);
+}
+
+// XO-CHIP. F000 NNNN loads a 16-bit I from the word after it, so the
+// instruction is four bytes long.
+template <class Q>
+constexpr void Chip8::OpF000(const Instr&) {
+    if (!Q::xoChip) return;
+    I = ReadOpcode(pc);
+    pc += 2;
+}
+
+// Selects the planes that draw, clear and scroll act on.
+template <class Q>
+constexpr void Chip8::OpFn01(const Instr& in) {
+    if (Q::xoChip) planeMask = in.x & ((1 << PLANE_COUNT) - 1);
+}
+
+// Loads the 128-bit audio pattern from I.
+template <class Q>
+constexpr void Chip8::OpF002(const Instr&) {
+    if (Q::xoChip) std::copy_n(GuestSpan(AUDIO_PATTERN_SIZE), AUDIO_PATTERN_SIZE, audio);
+}
+
+template <class Q>
+constexpr void Chip8::OpFx3A(const Instr& in) {
+    if (Q::xoChip) pitch = V[in.x];
+}
+
+// ----------------------------------------------------------------------
+// Display composition
+// ----------------------------------------------------------------------
+void Chip8::Compose(uint8_t* out) const {
+    int width = hires ? HIRES_WIDTH : DISPLAY_WIDTH;
+    int height = hires ? HIRES_HEIGHT : DISPLAY_HEIGHT;
+    for (int y = 0; y < height; ++y) {
+        const uint64_t* row0 = hires ? &plane[0][y * 2] : &display[0][y];
+        const uint64_t* row1 = hires ? &plane[1][y * 2] : &display[1][y];
+        simd.expandRow(row0, row1, width / 64, &out[y * width]);
+    }
+}
+
+// ----------------------------------------------------------------------
+// Compile-time checks
+// ----------------------------------------------------------------------
+// Small ROMs run through the switch engine while this file compiles, so
+// a change that breaks an opcode breaks the build.
+template <size_t N, class Check>
+static constexpr bool RomCheck(const uint8_t (&rom)[N], int cycles, Check check,
+                               Quirks quirks = Quirks::Legacy) {
+    Chip8 chip8;
+    chip8.SetQuirks(quirks);
+    chip8.LoadROM(rom, N);
+    for (int i = 0; i < cycles; ++i) chip8.Cycle();
+    return check(chip8);
+}
+
+// Reset puts the font at FONTSET_ADDR.
+static_assert(RomCheck({0x12, 0x00}, 0, [](Chip8& c) {
+    return c.Peek(FONTSET_ADDR) == 0xF0 && c.Peek(FONTSET_ADDR + FONTSET_SIZE - 1) == 0x80;
+}));
+// 8xy4 carries into VF; 8xy5 clears VF on a borrow.
+static_assert(RomCheck({0x60, 0xFF, 0x61, 0x01, 0x80, 0x14}, 3, [](Chip8& c) {
+    return c.GetV(0) == 0x00 && c.GetV(0xF) == 1;
+}));
+static_assert(RomCheck({0x60, 0x01, 0x61, 0x02, 0x80, 0x15}, 3, [](Chip8& c) {
+    return c.GetV(0) == 0xFF && c.GetV(0xF) == 0;
+}));
+// 8xy6 shifts VY, or VX in place under SCHIP.
+static_assert(RomCheck({0x60, 0x03, 0x61, 0x04, 0x80, 0x16}, 3, [](Chip8& c) {
+    return c.GetV(0) == 2 && c.GetV(0xF) == 0;
+}));
+static_assert(RomCheck({0x60, 0x03, 0x61, 0x04, 0x80, 0x16}, 3, [](Chip8& c) {
+    return c.GetV(0) == 1 && c.GetV(0xF) == 1;
+}, Quirks::Schip));
+// 8xy1 resets VF on the VIP only.
+static_assert(RomCheck({0x6F, 0x05, 0x60, 0x01, 0x80, 0x11}, 3, [](Chip8& c) {
+    return c.GetV(0xF) == 5;
+}));
+static_assert(RomCheck({0x6F, 0x05, 0x60, 0x01, 0x80, 0x11}, 3, [](Chip8& c) {
+    return c.GetV(0xF) == 0;
+}, Quirks::Vip));
+// 2NNN/00EE round trip, then 3xkk skipping.
+static_assert(RomCheck({0x22, 0x06, 0x6A, 0x01, 0x12, 0x04, 0x6B, 0x02, 0x00, 0xEE}, 5, [](Chip8& c) {
+    return c.GetPC() == 0x204 && c.GetV(0xA) == 1 && c.GetV(0xB) == 2;
+}));
+static_assert(RomCheck({0x60, 0x07, 0x30, 0x07, 0x61, 0x01, 0x62, 0x02}, 3, [](Chip8& c) {
+    return c.GetV(1) == 0 && c.GetV(2) == 2 && c.GetPC() == 0x208;
+}));
+// BNNN adds V0, or VX under SCHIP.
+static_assert(RomCheck({0x60, 0x20, 0x61, 0x04, 0xB1, 0x10}, 3, [](Chip8& c) {
+    return c.GetPC() == 0x130;
+}));
+static_assert(RomCheck({0x60, 0x20, 0x61, 0x04, 0xB1, 0x10}, 3, [](Chip8& c) {
+    return c.GetPC() == 0x114;
+}, Quirks::Schip));
+// Fx33 stores BCD; Fx55 leaves I alone except on the VIP.
+static_assert(RomCheck({0x60, 0xFE, 0xA3, 0x00, 0xF0, 0x33}, 3, [](Chip8& c) {
+    return c.Peek(0x300) == 2 && c.Peek(0x301) == 5 && c.Peek(0x302) == 4;
+}));
+static_assert(RomCheck({0x60, 0x11, 0x61, 0x22, 0xA3, 0x00, 0xF1, 0x55}, 4, [](Chip8& c) {
+    return c.Peek(0x300) == 0x11 && c.Peek(0x301) == 0x22 && c.GetI() == 0x300;
+}));
+static_assert(RomCheck({0x60, 0x11, 0x61, 0x22, 0xA3, 0x00, 0xF1, 0x55}, 4, [](Chip8& c) {
+    return c.GetI() == 0x302;
+}, Quirks::Vip));
+// Drawing a glyph twice erases it and reports the collision.
+static_assert(RomCheck({0xA0, 0x00, 0xD0, 0x05}, 2, [](Chip8& c) {
+    return c.GetLoresRow(0) >> 56 == 0xF0 && c.GetV(0xF) == 0;
+}));
+static_assert(RomCheck({0xA0, 0x00, 0xD0, 0x05, 0xD0, 0x05}, 3, [](Chip8& c) {
+    return c.GetLoresRow(0) == 0 && c.GetV(0xF) == 1;
+}));
+// Fx0A halts until a key goes down and up again.
+static_assert(RomCheck({0xF3, 0x0A, 0x64, 0x01}, 2, [](Chip8& c) {
+    bool waited = c.IsHalted() && c.GetV(4) == 0;
+    c.SetKey(5, true);
+    c.SetKey(5, false);
+    c.Cycle();
+    return waited && !c.IsHalted() && c.GetV(3) == 5 && c.GetV(4) == 1;
+}));
+// Cxkk masks with kk and does not repeat itself.
+static_assert(RomCheck({0xC0, 0x0F, 0xC1, 0xFF, 0xC2, 0xFF}, 3, [](Chip8& c) {
+    return c.GetV(0) <= 0x0F && c.GetV(1) != c.GetV(2);
+}));
+// Out-of-range accesses wrap and are counted: Fx55/Fx65 across the end of
+// memory, a 17th nested call, a key index above F.
+static_assert(RomCheck({0x60, 0x11, 0x61, 0x22, 0x62, 0x33, 0x63, 0x44, 0xAF, 0xFE, 0xF3, 0x55,
+                        0x60, 0x00, 0x63, 0x00, 0xF3, 0x65}, 9, [](Chip8& c) {
+    return c.Peek(0xFFF) == 0x22 && c.Peek(0x000) == 0x33 && c.Peek(0x001) == 0x44 &&
+           c.GetV(0) == 0x11 && c.GetV(3) == 0x44 && c.GetFaultCount() == 2;
+}));
+static_assert(RomCheck({0x22, 0x00}, 17, [](Chip8& c) { return c.GetFaultCount() == 1; }));
+static_assert(RomCheck({0x60, 0xFF, 0xE0, 0xA1}, 2, [](Chip8& c) {
+    return c.GetPC() == 0x206 && c.GetFaultCount() == 1;
+}));
+// 00FF switches SUPER-CHIP to hires, where a sprite at x = 62 straddles
+// the two words of a row; elsewhere 00FF is ignored.
+static_assert(RomCheck({0x00, 0xFF, 0x60, 0x3E, 0xA0, 0x00, 0xD0, 0x15}, 4, [](Chip8& c) {
+    return c.IsHires() && (c.GetHiresRow(0)[0] & 3) == 3 && c.GetHiresRow(0)[1] >> 62 == 3 &&
+           c.GetLoresRow(0) == 0;
+}, Quirks::Schip));
+static_assert(RomCheck({0x00, 0xFF, 0x60, 0x3E, 0xA0, 0x00, 0xD0, 0x15}, 4, [](Chip8& c) {
+    return !c.IsHires() && (c.GetLoresRow(0) >> 1 & 1) == 1;
+}));
+// Scrolls: right by 4, then down by 1.
+static_assert(RomCheck({0x00, 0xFF, 0xA0, 0x00, 0xD0, 0x05, 0x00, 0xFB, 0x00, 0xC1}, 5, [](Chip8& c) {
+    return c.GetHiresRow(0)[0] == 0 && c.GetHiresRow(1)[0] >> 56 == 0x0F;
+}, Quirks::Schip));
+// Dxy0 draws 16x16 and reports a collision with 0/1.
+static_assert(RomCheck({0x00, 0xFF, 0x60, 0x70, 0xA0, 0x50, 0xD0, 0x10, 0xD0, 0x10}, 4, [](Chip8& c) {
+    return c.GetHiresRow(0)[1] == 0xFFFF && c.GetHiresRow(1)[1] == 0xC3C3 && c.GetV(0xF) == 0;
+}, Quirks::Schip));
+static_assert(RomCheck({0x00, 0xFF, 0x60, 0x70, 0xA0, 0x50, 0xD0, 0x10, 0xD0, 0x10}, 5, [](Chip8& c) {
+    return c.GetHiresRow(0)[1] == 0 && c.GetV(0xF) == 1;
+}, Quirks::Schip));
+// Fx30 points at the big font; Fx75/Fx85 keep registers across a clear.
+static_assert(RomCheck({0x60, 0x07, 0xF0, 0x30, 0x61, 0x2A, 0xF1, 0x75, 0x61, 0x00, 0xF1, 0x85}, 6,
+                       [](Chip8& c) {
+    return c.GetI() == BIGFONT_ADDR + 70 && c.GetV(1) == 0x2A;
+}, Quirks::Schip));
+// XO-CHIP: a skip steps over all of F000 NNNN, which elsewhere is two
+// instructions.
+static_assert(RomCheck({0x30, 0x00, 0xF0, 0x00, 0x12, 0x34, 0x61, 0x01}, 2, [](Chip8& c) {
+    return c.GetV(1) == 1 && c.GetPC() == 0x208 && c.GetI() == 0;
+}, Quirks::XoChip));
+static_assert(RomCheck({0x30, 0x00, 0xF0, 0x00, 0x12, 0x34, 0x61, 0x01}, 2, [](Chip8& c) {
+    return c.GetPC() == 0x234;
+}));
+// F000 NNNN reaches the whole 64 KB.
+static_assert(RomCheck({0xF0, 0x00, 0xFF, 0xF0, 0x60, 0xAB, 0xF0, 0x55}, 3, [](Chip8& c) {
+    return c.GetI() == 0xFFF1 && c.Peek(0xFFF0) == 0xAB && c.GetFaultCount() == 0;
+}, Quirks::XoChip));
+// 5xy2/5xy3 store and load a register range, backwards when x > y, and
+// leave I alone.
+static_assert(RomCheck({0x61, 0x01, 0x62, 0x02, 0x63, 0x03, 0xA3, 0x00, 0x53, 0x12,
+                        0x61, 0x00, 0x62, 0x00, 0x52, 0x13}, 8, [](Chip8& c) {
+    return c.Peek(0x300) == 3 && c.Peek(0x302) == 1 && c.GetV(2) == 3 && c.GetV(1) == 2 &&
+           c.GetI() == 0x300;
+}, Quirks::XoChip));
+// Fn01 picks the planes Dxyn draws to; with both, plane 1's sprite
+// follows plane 0's.
+static_assert(RomCheck({0x00, 0xFF, 0xF2, 0x01, 0xA0, 0x00, 0xD0, 0x01}, 4, [](Chip8& c) {
+    return c.GetHiresRow(0, 0)[0] == 0 && c.GetHiresRow(0, 1)[0] >> 56 == 0xF0;
+}, Quirks::XoChip));
+static_assert(RomCheck({0x00, 0xFF, 0xF3, 0x01, 0xA0, 0x00, 0xD0, 0x01}, 4, [](Chip8& c) {
+    return c.GetHiresRow(0, 0)[0] >> 56 == 0xF0 && c.GetHiresRow(0, 1)[0] >> 56 == 0x90;
+}, Quirks::XoChip));
+
+// MegaChip sprite rows: index 0 leaves the screen alone, and an opaque
+// pixel landing on the collision colour is a hit.
+static_assert([] {
+    uint8_t dst[20] = {};
+    uint8_t src[20];
+    for (int i = 0; i < 20; ++i) src[i] = i % 3;
+    dst[3] = 7;
+    dst[4] = 7;
+    bool hit = BlitIndexedRow(dst, src, 20, 7);
+    return hit && dst[0] == 0 && dst[1] == 1 && dst[3] == 7 && dst[4] == 1 && dst[17] == 2;
+}());
+static_assert([] {
+    uint8_t dst[4] = {9, 9, 0, 0};
+    const uint8_t src[4] = {0, 0, 5, 5};
+    return !BlitIndexedRow(dst, src, 4, 9) && dst[0] == 9 && dst[2] == 5;
+}());
+// Outside MegaChip, 01NN is a machine-code call and the word after it runs.
+static_assert(RomCheck({0x01, 0x12, 0x63, 0x45}, 2, [](Chip8& c) {
+    return c.GetV(3) == 0x45 && c.GetI() == 0;
+}, Quirks::Schip));
+
+// The IR passes, each on its own: the optimised list must leave V, I and
+// pc as the interpreter does, and expect says the pass did something.
+template <size_t N, class Pass, class Expect>
+static constexpr bool IrCheck(const uint8_t (&rom)[N], Pass pass, Expect expect,
+                              Quirks quirks = Quirks::Legacy) {
+    Chip8 ref;
+    Chip8 opt;
+    ref.SetQuirks(quirks);
+    opt.SetQuirks(quirks);
+    ref.LoadROM(rom, N);
+    opt.LoadROM(rom, N);
+    std::vector<IrOp> ops = opt.TranslateIr(START_ADDR);
+    for (size_t i = 0; i < ops.size(); ++i) ref.Cycle();
+    pass(ops, FlagsOf(quirks));
+    opt.RunIr(ops);
+    for (int r = 0; r < 16; ++r) {
+        if (ref.GetV(r) != opt.GetV(r)) return false;
+    }
+    return ref.GetI() == opt.GetI() && ref.GetPC() == opt.GetPC() && expect(ops);
+}
+
+// 7XKK and 8XY0 on known registers become loads; reloading a value is dead.
+static_assert(IrCheck({0x61, 0x05, 0x71, 0x03, 0x82, 0x10, 0x62, 0x08, 0x12, 0x00},
+                      IrPropagateConstants, [](const std::vector<IrOp>& ops) {
+    return ops[1].in.opcode == 0x6108 && ops[2].in.opcode == 0x6208 && (ops[3].flags & IR_DEAD);
+}));
+// 8xy4's carry is dead when VF is loaded before anything reads it, but not
+// across a skip, which may leave the block.
+static_assert(IrCheck({0x60, 0xF0, 0x61, 0x20, 0x80, 0x14, 0x6F, 0x02, 0x81, 0x04, 0x3F, 0x01},
+                      IrRemoveDeadStores, [](const std::vector<IrOp>& ops) {
+    return (ops[2].flags & IR_NO_VF) && !(ops[4].flags & IR_NO_VF);
+}));
+// Under the VIP's vfReset the clear is the only VF write of 8xy1.
+static_assert(IrCheck({0x6F, 0x07, 0x80, 0x11, 0x6F, 0x03, 0xF0, 0x29, 0x12, 0x00},
+                      IrRemoveDeadStores, [](const std::vector<IrOp>& ops) {
+    return (ops[1].flags & IR_NO_VF) && (ops[0].flags & IR_DEAD);
+}, Quirks::Vip));
+// ANNN; FX1E folds to one ANNN, and the first becomes dead.
+static_assert(IrCheck({0xA3, 0x00, 0x60, 0x04, 0xF0, 0x1E, 0x61, 0x02, 0xF1, 0x1E, 0xD0, 0x15},
+                      [](std::vector<IrOp>& ops, const QuirkFlags& q) { OptimizeIr(ops, q, false); },
+                      [](const std::vector<IrOp>& ops) {
+    return (ops[0].flags & IR_DEAD) && (ops[2].flags & IR_DEAD) && ops[4].in.opcode == 0xA306;
+}));
+// A loop's only ANNN, ahead of any read of I, is hoisted.
+static_assert(IrCheck({0x70, 0x01, 0xA2, 0x10, 0xF0, 0x1E, 0x30, 0x10},
+                      IrHoistIndex, [](const std::vector<IrOp>& ops) {
+    return !(ops[1].flags & IR_HOISTED);
+}));
+static_assert(IrCheck({0x70, 0x01, 0xA2, 0x10, 0x81, 0x04, 0x30, 0x10},
+                      IrHoistIndex, [](const std::vector<IrOp>& ops) {
+    return (ops[1].flags & IR_HOISTED) != 0;
+}));
+
+// ----------------------------------------------------------------------
+// Basic-block translation cache
+// ----------------------------------------------------------------------
+
+Chip8::Block* Chip8::TranslateBlock(uint16_t addr) {
+    std::unique_ptr<Block> block(new Block);
+    block->start = addr;
+    block->succ[0] = block->succ[1] = nullptr;
+
+    std::vector<IrOp> ir = TranslateIr(addr);
+    OptimizeIr(ir, FlagsOf(quirks), false);
+    for (const IrOp& op : ir) {
+        blockCache->code.MarkInstr(op.addr);
+        if (!(op.flags & IR_DEAD)) block->ops.push_back({IrHandler(op), op.in, FUSE_NONE, 1});
+    }
+    uint16_t a = addr;
+    uint8_t id = OP_NOP;
+    Instr in = {};
+    if (!ir.empty()) {
+        a = ir.back().addr + 2;
+        id = ir.back().id;
+        in = ir.back().in;
+    }
+    block->end = a;
+    block->length = static_cast<uint16_t>(ir.size());
+
+    // a is the address after the terminator, which is what pc holds
+    // when the terminator runs.
+    switch (id) {
+        case OP_1NNN: case OP_2NNN:
+            block->succPc[0] = in.nnn;
+            block->succPc[1] = NO_SUCCESSOR;
+            break;
+        case OP_3XKK: case OP_4XKK: case OP_5XY0: case OP_9XY0:
+        case OP_EX9E: case OP_EXA1:
+            block->succPc[0] = a;
+            block->succPc[1] = a - 2 + SkipLength(a - 2);
+            break;
+        case OP_00EE: case OP_BNNN:
+            block->succPc[0] = block->succPc[1] = NO_SUCCESSOR;
+            break;
+        case OP_00FD:
+            block->succPc[0] = a - 2;
+            block->succPc[1] = NO_SUCCESSOR;
+            break;
+        case OP_F000: case OP_01NN:
+            blockCache->code.MarkInstr(a);
+            block->succPc[0] = a + 2;
+            block->succPc[1] = NO_SUCCESSOR;
+            break;
+        default:
+            block->succPc[0] = a;
+            block->succPc[1] = NO_SUCCESSOR;
+            break;
+    }
+
+    Block* raw = block.get();
+    blockCache->blocks[addr] = std::move(block);
+    return raw;
+}
+
+Chip8::Block* Chip8::LookupBlock(uint16_t addr) {
+    auto it = blockCache->blocks.find(addr);
+    if (it != blockCache->blocks.end()) return it->second.get();
+    return TranslateBlock(addr);
+}
+
+uint32_t Chip8::RunBlocks(uint32_t count) {
+    if (!blockCache) blockCache.reset(new BlockCache);
+
+    Block* block = nullptr;
+    while (count > 0) {
+        if (blockCache->code.dirty) {
+            blockCache->Flush();
+            block = nullptr;
+        }
+        if (!block) block = LookupBlock(pc &= memSize - 1);
+
+        uint32_t len = block->length;
+        if (block->ops.empty() || len > count) {
+            // Not enough budget left for the whole block.
+            while (count > 0) {
+                StepPredecoded();
+                --count;
+                if (stopHit) break;
+            }
+            return count;
+        }
+
+        // Only the terminator reads or writes pc, so it is set once.
+        const DecodedOp* op = block->ops.data();
+        const DecodedOp* last = op + block->ops.size() - 1;
+        for (; op != last; ++op) op->fn(*this, op->in);
+        pc = block->end;
+        last->fn(*this, last->in);
+        count -= len;
+        // Only terminators raise stop events.
+        if (stopHit) break;
+
+        if (blockCache->code.dirty) {
+            block = nullptr;
+        } else if (pc == block->succPc[0]) {
+            if (!block->succ[0]) block->succ[0] = LookupBlock(pc);
+            block = block->succ[0];
+        } else if (pc == block->succPc[1]) {
+            if (!block->succ[1]) block->succ[1] = LookupBlock(pc);
+            block = block->succ[1];
+        } else {
+            block = nullptr;
+        }
+    }
+    return count;
+}
+
+// ----------------------------------------------------------------------
+// x86-64 dynamic recompiler
+// ----------------------------------------------------------------------
+#if CHIP8_HAVE_JIT
+
+// Minimal encoder for the 32-bit register forms the recompiler needs.
+// Memory operands are always [rdi + disp32], rdi holding the Chip8*.
+class X64Emitter {
+public:
+    enum Reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+    enum AluOp { ADD = 0, OR = 1, AND = 4, SUB = 5, XOR = 6, CMP = 7 };
+    enum Cond { CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7 };
+
+    X64Emitter(uint8_t* buf, size_t cap) : buf(buf), cap(cap), pos(0) {}
+
+    size_t Pos() const { return pos; }
+    bool Overflowed() const { return pos > cap; }
+
+    void MovImm(Reg r, uint32_t imm) { Rex(0, r); Byte(0xB8 + (r & 7)); Dword(imm); }
+    void Mov(Reg dst, Reg src) { Rex(src, dst); Byte(0x89); ModRM(3, src, dst); }
+    void Alu(AluOp op, Reg dst, Reg src) { Rex(src, dst); Byte((op << 3) | 1); ModRM(3, src, dst); }
+
+    void AluImm(AluOp op, Reg r, uint32_t imm) {
+        Rex(0, r);
+        if (imm <= 0x7F) {
+            Byte(0x83); ModRM(3, op, r); Byte(static_cast<uint8_t>(imm));
+        } else {
+            Byte(0x81); ModRM(3, op, r); Dword(imm);
+        }
+    }
+
+    void ShlImm(Reg r, uint8_t n) { Rex(0, r); Byte(0xC1); ModRM(3, 4, r); Byte(n); }
+    void ShrImm(Reg r, uint8_t n) { Rex(0, r); Byte(0xC1); ModRM(3, 5, r); Byte(n); }
+    void ImulImm(Reg dst, Reg src, int8_t imm) {
+        Rex(dst, src); Byte(0x6B); ModRM(3, dst, src); Byte(static_cast<uint8_t>(imm));
+    }
+
+    void LoadU8(Reg dst, int32_t disp)  { Rex(dst, RDI); Byte(0x0F); Byte(0xB6); Mem(dst, disp); }
+    void LoadU16(Reg dst, int32_t disp) { Rex(dst, RDI); Byte(0x0F); Byte(0xB7); Mem(dst, disp); }
+    void LoadU32(Reg dst, int32_t disp) { Rex(dst, RDI); Byte(0x8B); Mem(dst, disp); }
+    void StoreU8(int32_t disp, Reg src) {
+        // spl/bpl/sil/dil are only reachable with a REX prefix
+        Rex(src, RDI, src >= RSP && src <= RDI); Byte(0x88); Mem(src, disp);
+    }
+    void StoreU16(int32_t disp, Reg src) { Byte(0x66); Rex(src, RDI); Byte(0x89); Mem(src, disp); }
+    void StoreU32(int32_t disp, Reg src) { Rex(src, RDI); Byte(0x89); Mem(src, disp); }
+
+    void SetA(Reg r) { Byte(0x0F); Byte(0x97); ModRM(3, 0, r); }  // r must be AL..BL
+
+    size_t Jcc(Cond cc) { Byte(0x0F); Byte(0x80 | cc); Dword(0); return pos - 4; }
+    size_t Jmp() { Byte(0xE9); Dword(0); return pos - 4; }
+    void Patch(size_t at, size_t target) {
+        if (at + 4 > cap) return;
+        uint32_t rel = static_cast<uint32_t>(target - (at + 4));
+        std::memcpy(buf + at, &rel, 4);
+    }
+
+    void Push(Reg r) { if (r >= R8) Byte(0x41); Byte(0x50 + (r & 7)); }
+    void Pop(Reg r)  { if (r >= R8) Byte(0x41); Byte(0x58 + (r & 7)); }
+    void Ret() { Byte(0xC3); }
+
+private:
+    uint8_t* buf;
+    size_t   cap;
+    size_t   pos;
+
+    void Byte(uint8_t b) {
+        if (pos < cap) buf[pos] = b;
+        ++pos;
+    }
+    void Dword(uint32_t d) { for (int i = 0; i < 4; ++i) Byte((d >> (8 * i)) & 0xFF); }
+    void Rex(int reg, int rm, bool force = false) {
+        uint8_t rex = 0x40 | ((reg >> 3) << 2) | (rm >> 3);
+        if (rex != 0x40 || force) Byte(rex);
+    }
+    void ModRM(int mod, int reg, int rm) { Byte((mod << 6) | ((reg & 7) << 3) | (rm & 7)); }
+    void Mem(int reg, int32_t disp) { ModRM(2, reg, RDI); Dword(static_cast<uint32_t>(disp)); }
+};
+
+constexpr int JIT_MAX_REGION_OPS = 128;
+
+static bool JitSupports(uint8_t id) {
+    switch (id) {
+        case OP_NOP: case OP_1NNN:
+        case OP_3XKK: case OP_4XKK: case OP_5XY0: case OP_9XY0:
+        case OP_6XKK: case OP_7XKK:
+        case OP_8XY0: case OP_8XY1: case OP_8XY2: case OP_8XY3: case OP_8XY4:
+        case OP_8XY5: case OP_8XY6: case OP_8XY7: case OP_8XYE:
+        case OP_ANNN: case OP_FX1E: case OP_FX29:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// V registers an instruction reads or writes, as a bit mask.
+static uint16_t JitRegsUsed(uint8_t id, const Instr& in, const QuirkFlags& quirks) {
+    switch (id) {
+        case OP_3XKK: case OP_4XKK: case OP_6XKK: case OP_7XKK:
+        case OP_FX1E: case OP_FX29:
+            return 1 << in.x;
+        case OP_8XY1: case OP_8XY2: case OP_8XY3:
+            return (1 << in.x) | (1 << in.y) | (quirks.vfReset ? 1 << 0xF : 0);
+        case OP_5XY0: case OP_9XY0: case OP_8XY0:
+            return (1 << in.x) | (1 << in.y);
+        case OP_8XY4: case OP_8XY5: case OP_8XY6: case OP_8XY7: case OP_8XYE:
+            return (1 << in.x) | (1 << in.y) | (1 << 0xF);
+        default:
+            return 0;
+    }
+}
+
+static uint16_t JitRegsWritten(uint8_t id, const Instr& in, const QuirkFlags& quirks) {
+    switch (id) {
+        case OP_8XY1: case OP_8XY2: case OP_8XY3:
+            return (1 << in.x) | (quirks.vfReset ? 1 << 0xF : 0);
+        case OP_6XKK: case OP_7XKK: case OP_8XY0:
+            return 1 << in.x;
+        case OP_8XY4: case OP_8XY5: case OP_8XY6: case OP_8XY7: case OP_8XYE:
+            return (1 << in.x) | (1 << 0xF);
+        default:
+            return 0;
+    }
+}
+
+// A region follows unconditional jumps from its entry pc. A jump back to
+// the entry becomes a native loop, so V registers and I stay in host
+// registers across iterations. Skips leave the region when taken. Any
+// other instruction ends the region and is left to the interpreter.
+const Chip8::JitRegion& Chip8::CompileRegion(uint16_t start) {
+    using R = X64Emitter::Reg;
+    static const R pool[] = {
+        X64Emitter::RSI, X64Emitter::R9,  X64Emitter::R10, X64Emitter::R11, X64Emitter::RBX,
+        X64Emitter::RBP, X64Emitter::R12, X64Emitter::R13, X64Emitter::R14, X64Emitter::R15,
+    };
+    const int poolSize = sizeof(pool) / sizeof(pool[0]);
+
+    if (const JitRegion* stored = RestoreRegion(start)) return *stored;
+
+    // Walk the guest code first so the register assignment is known
+    // before anything is emitted.
+    const QuirkFlags quirkFlags = FlagsOf(quirks);
+    std::vector<IrOp> steps;
+    std::vector<uint16_t> checked;
+    std::vector<uint8_t> visited(CodeSize(), 0);
+    uint16_t used = 0;
+    uint16_t written = 0;
+    bool usesI = false;
+    bool loops = false;
+    uint16_t exitPc = start;
+    uint16_t a = start;
+    for (;;) {
+        if (steps.size() >= JIT_MAX_REGION_OPS || a + 1u >= memSize || visited[a]) {
+            exitPc = a;
+            break;
+        }
+        uint16_t opcode = ReadOpcode(a);
+        uint8_t id = ids[opcode];
+        Instr in = DecodeInstr(opcode);
+        uint16_t regs = used | JitRegsUsed(id, in, quirkFlags);
+        // Skips over an XO-CHIP F000 NNNN are left to the interpreter.
+        bool longSkip = IsSkip(id) && SkipLength(a) != 4;
+        if (!JitSupports(id) || longSkip || __builtin_popcount(regs) > poolSize) {
+            exitPc = a;
+            break;
+        }
+        used = regs;
+        if (IsSkip(id)) checked.push_back(a + 2);
+        steps.push_back({a, id, 0, in});
+        visited[a] = 1;
+        jit->code.MarkInstr(a);
+
+        if (id == OP_1NNN) {
+            if (in.nnn == start) {
+                loops = true;
+                break;
+            }
+            if (visited[in.nnn] || in.nnn + 1u >= memSize) {
+                exitPc = in.nnn;
+                break;
+            }
+            a = in.nnn;
+        } else {
+            a += 2;
+        }
+    }
+
+    JitRegion& region = jit->regions[start];
+    region.fn = nullptr;
+    region.maxPath = static_cast<uint32_t>(steps.size());
+    if (steps.empty()) return region;
+
+    // Registers again for what is left after the passes.
+    OptimizeIr(steps, quirkFlags, loops);
+    used = 0;
+    for (const IrOp& st : steps) {
+        if (st.flags & IR_DEAD) continue;
+        uint16_t vf = st.flags & IR_NO_VF ? 1 << 0xF : 0;
+        used |= JitRegsUsed(st.id, st.in, quirkFlags) & ~vf;
+        written |= JitRegsWritten(st.id, st.in, quirkFlags) & ~vf;
+        usesI = usesI || st.id == OP_ANNN || st.id == OP_FX1E || st.id == OP_FX29;
+    }
+
+    R vreg[16];
+    R saved[16];
+    std::fill(vreg, vreg + 16, X64Emitter::RAX);
+    int savedCount = 0;
+    for (int i = 0, next = 0; i < 16; ++i) {
+        if (!(used & (1 << i))) continue;
+        vreg[i] = pool[next++];
+        if (vreg[i] == X64Emitter::RBX || vreg[i] == X64Emitter::RBP || vreg[i] >= X64Emitter::R12) {
+            saved[savedCount++] = vreg[i];
+        }
+    }
+    const R regI = X64Emitter::R8;
+    const R budget = X64Emitter::RAX;
+    const R t0 = X64Emitter::RCX;
+    const R t1 = X64Emitter::RDX;
+
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(this);
+    const int32_t offV  = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(V) - base);
+    const int32_t offI  = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(&I) - base);
+    const int32_t offPc = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(&pc) - base);
+
+    X64Emitter e(jit->buffer + jit->used, JIT_CODE_SIZE - jit->used);
+
+    // Prologue: rdi = this, esi = budget
+    for (int i = 0; i < savedCount; ++i) e.Push(saved[i]);
+    e.Mov(budget, X64Emitter::RSI);
+    for (int i = 0; i < 16; ++i) {
+        if (used & (1 << i)) e.LoadU8(vreg[i], offV + i);
+    }
+    if (usesI) e.LoadU32(regI, offI);
+    for (const IrOp& st : steps) {
+        if (st.flags & IR_HOISTED) e.MovImm(regI, st.in.nnn);
+    }
+    size_t top = e.Pos();
+
+    struct Exit {
+        size_t   patch;
+        uint16_t pc;
+        uint32_t count;
+    };
+    std::vector<Exit> exits;
+    uint32_t n = 0;
+
+    for (const IrOp& st : steps) {
+        const Instr& in = st.in;
+        R vx = vreg[in.x];
+        R vy = vreg[in.y];
+        R vf = vreg[0xF];
+        ++n;
+        if (st.flags & (IR_DEAD | IR_HOISTED)) continue;
+        if (st.flags & IR_NO_VF) {
+            R src = quirkFlags.shiftVx ? vx : vy;
+            switch (st.id) {
+                case OP_8XY1: e.Alu(X64Emitter::OR, vx, vy); break;
+                case OP_8XY2: e.Alu(X64Emitter::AND, vx, vy); break;
+                case OP_8XY3: e.Alu(X64Emitter::XOR, vx, vy); break;
+                case OP_8XY4: e.Alu(X64Emitter::ADD, vx, vy); e.AluImm(X64Emitter::AND, vx, 0xFF); break;
+                case OP_8XY5: e.Alu(X64Emitter::SUB, vx, vy); e.AluImm(X64Emitter::AND, vx, 0xFF); break;
+                case OP_8XY7:
+                    e.Mov(t0, vy);
+                    e.Alu(X64Emitter::SUB, t0, vx);
+                    e.AluImm(X64Emitter::AND, t0, 0xFF);
+                    e.Mov(vx, t0);
+                    break;
+                case OP_8XY6: e.Mov(t0, src); e.ShrImm(t0, 1); e.Mov(vx, t0); break;
+                case OP_8XYE:
+                    e.Mov(t0, src);
+                    e.ShlImm(t0, 1);
+                    e.AluImm(X64Emitter::AND, t0, 0xFF);
+                    e.Mov(vx, t0);
+                    break;
+            }
+            continue;
+        }
+        switch (st.id) {
+            case OP_6XKK: e.MovImm(vx, in.kk); break;
+            case OP_7XKK: e.AluImm(X64Emitter::ADD, vx, in.kk); e.AluImm(X64Emitter::AND, vx, 0xFF); break;
+            case OP_8XY0: if (in.x != in.y) e.Mov(vx, vy); break;
+            case OP_8XY1: e.Alu(X64Emitter::OR, vx, vy); if (quirkFlags.vfReset) e.MovImm(vf, 0); break;
+            case OP_8XY2: e.Alu(X64Emitter::AND, vx, vy); if (quirkFlags.vfReset) e.MovImm(vf, 0); break;
+            case OP_8XY3: e.Alu(X64Emitter::XOR, vx, vy); if (quirkFlags.vfReset) e.MovImm(vf, 0); break;
+            case OP_8XY4:
+                e.Mov(t0, vx);
+                e.Alu(X64Emitter::ADD, t0, vy);
+                e.Mov(t1, t0);
+                e.ShrImm(t1, 8);
+                e.AluImm(X64Emitter::AND, t0, 0xFF);
+                e.Mov(vf, t1);
+                e.Mov(vx, t0);
+                break;
+            // The interpreter stores VF before computing the result, so
+            // with x or y == F the result sees the new flag. Keep that order.
+            case OP_8XY5:
+            case OP_8XY7: {
+                R lhs = st.id == OP_8XY5 ? vx : vy;
+                R rhs = st.id == OP_8XY5 ? vy : vx;
+                e.Alu(X64Emitter::XOR, t1, t1);
+                e.Alu(X64Emitter::CMP, lhs, rhs);
+                e.SetA(t1);
+                e.Mov(vf, t1);
+                e.Mov(t0, lhs);
+                e.Alu(X64Emitter::SUB, t0, rhs);
+                e.AluImm(X64Emitter::AND, t0, 0xFF);
+                e.Mov(vx, t0);
+                break;
+            }
+            case OP_8XY6: {
+                R src = quirkFlags.shiftVx ? vx : vy;
+                e.Mov(t1, src);
+                e.AluImm(X64Emitter::AND, t1, 1);
+                e.Mov(vf, t1);
+                e.Mov(t0, src);
+                e.ShrImm(t0, 1);
+                e.Mov(vx, t0);
+                break;
+            }
+            case OP_8XYE: {
+                R src = quirkFlags.shiftVx ? vx : vy;
+                e.Mov(t1, src);
+                e.ShrImm(t1, 7);
+                e.Mov(vf, t1);
+                e.Mov(t0, src);
+                e.ShlImm(t0, 1);
+                e.AluImm(X64Emitter::AND, t0, 0xFF);
+                e.Mov(vx, t0);
+                break;
+            }
+            case OP_ANNN: e.MovImm(regI, in.nnn); break;
+            case OP_FX1E:
+                e.Alu(X64Emitter::ADD, regI, vx);
+                e.AluImm(X64Emitter::AND, regI, quirkFlags.megaChip ? 0xFFFFFF : 0xFFFF);
+                break;
+            case OP_FX29:
+                e.ImulImm(regI, vx, 5);
+                if (FONTSET_ADDR) e.AluImm(X64Emitter::ADD, regI, FONTSET_ADDR);
+                break;
+            case OP_3XKK: e.AluImm(X64Emitter::CMP, vx, in.kk); exits.push_back({e.Jcc(X64Emitter::CC_E), static_cast<uint16_t>(st.addr + 4), n}); break;
+            case OP_4XKK: e.AluImm(X64Emitter::CMP, vx, in.kk); exits.push_back({e.Jcc(X64Emitter::CC_NE), static_cast<uint16_t>(st.addr + 4), n}); break;
+            case OP_5XY0: e.Alu(X64Emitter::CMP, vx, vy); exits.push_back({e.Jcc(X64Emitter::CC_E), static_cast<uint16_t>(st.addr + 4), n}); break;
+            case OP_9XY0: e.Alu(X64Emitter::CMP, vx, vy); exits.push_back({e.Jcc(X64Emitter::CC_NE), static_cast<uint16_t>(st.addr + 4), n}); break;
+            default: break;  // OP_NOP, OP_1NNN (already followed)
+        }
+    }
+
+    // Budget check on the back edge keeps Execute(n) exact: another pass
+    // is only taken when a whole one still fits.
+    if (loops) {
+        e.AluImm(X64Emitter::SUB, budget, n);
+        e.AluImm(X64Emitter::CMP, budget, region.maxPath);
+        e.Patch(e.Jcc(X64Emitter::CC_AE), top);
+        exits.push_back({e.Jmp(), start, 0});
+    } else {
+        exits.push_back({e.Jmp(), exitPc, n});
+    }
+
+    std::vector<size_t> toEpilogue;
+    for (const Exit& ex : exits) {
+        e.Patch(ex.patch, e.Pos());
+        if (ex.count) e.AluImm(X64Emitter::SUB, budget, ex.count);
+        e.MovImm(t0, ex.pc);
+        toEpilogue.push_back(e.Jmp());
+    }
+
+    for (size_t at : toEpilogue) e.Patch(at, e.Pos());
+    for (int i = 0; i < 16; ++i) {
+        if (written & (1 << i)) e.StoreU8(offV + i, vreg[i]);
+    }
+    if (usesI) e.StoreU32(offI, regI);
+    e.StoreU16(offPc, t0);
+    for (int i = savedCount - 1; i >= 0; --i) e.Pop(saved[i]);
+    e.Ret();
+
+    if (e.Overflowed()) {
+        // Caller flushes when space runs low, so this only happens for a
+        // region larger than the slack; interpret it instead.
+        return region;
+    }
+    region.fn = reinterpret_cast<uint32_t (*)(Chip8*, uint32_t)>(jit->buffer + jit->used);
+    jit->Record(start, steps, checked, *this, region.maxPath, jit->buffer + jit->used,
+                static_cast<uint32_t>(e.Pos()));
+    jit->used += e.Pos();
+    return region;
+}
+
+#endif  // CHIP8_HAVE_JIT
+
+uint32_t Chip8::RunJit(uint32_t count) {
+#if CHIP8_HAVE_JIT
+    if (!jit) {
+        jit.reset(new JitCache);
+        OpenJitCache();
+    }
+    if (!jit->buffer) return RunBlocks(count);
+    while (count > 0) {
+        if (jit->code.dirty || JIT_CODE_SIZE - jit->used < JIT_REGION_SLACK) jit->Flush();
+
+        pc &= memSize - 1;
+        auto it = jit->regions.find(pc);
+        const JitRegion& region = it != jit->regions.end() ? it->second : CompileRegion(pc);
+        if (!region.fn || region.maxPath > count) {
+            // Also where every op that can raise a stop event runs.
+            StepPredecoded();
+            --count;
+            if (stopHit) break;
+            continue;
+        }
+        count = region.fn(this, count);
+    }
+    return count;
+#else
+    return RunBlocks(count);
+#endif
+}
+
 // ----------------------------------------------------------------------
-// Chip8 class
+// On-disk cache
 // ----------------------------------------------------------------------
-class Chip8 {
-public:
-    Chip8();
-    void LoadROM(const std::string& filename);
-    void Cycle();
-    void UpdateTimers();
-    bool NeedsRedraw() const { return drawFlag; }
-    void ClearDrawFlag() { drawFlag = false; }
-    const uint8_t* GetDisplay() const { return display; }
-    void SetKey(int key, bool pressed) { keypad[key] = pressed; }
-    bool GetSoundState() const { return sound_timer > 0; }
-    void Reset();
 
-private:
-    uint8_t  memory[MEMORY_SIZE];
-    uint8_t  V[16];
-    uint16_t I;
-    uint16_t pc;
-    uint8_t  sp;
-    uint16_t stack[16];
-    uint8_t  delay_timer;
-    uint8_t  sound_timer;
-    uint8_t  keypad[16];
-    uint8_t  display[DISPLAY_WIDTH * DISPLAY_HEIGHT];
-    bool     drawFlag;
+// Artifacts go to $CATEMU_CACHE_DIR, else $XDG_CACHE_HOME/catemu, else
+// ~/.cache/catemu. Empty if none of those can be created.
+static std::string CacheDirectory() {
+#if CHIP8_HAVE_AOT
+    std::string dir;
+    if (const char* env = std::getenv("CATEMU_CACHE_DIR")) {
+        dir = env;
+    } else if (const char* xdg = std::getenv("XDG_CACHE_HOME")) {
+        dir = std::string(xdg) + "/catemu";
+    } else if (const char* home = std::getenv("HOME")) {
+        dir = std::string(home) + "/.cache/catemu";
+    } else {
+        return "";
+    }
+    for (size_t pos = 1; pos <= dir.size(); ++pos) {
+        if (pos == dir.size() || dir[pos] == '/') {
+            std::string part = dir.substr(0, pos);
+            if (mkdir(part.c_str(), 0755) != 0 && errno != EEXIST) return "";
+        }
+    }
+    return dir;
+#else
+    return "";
+#endif
+}
 
-    void Opcode0xxx(uint16_t opcode);
-    void Opcode1xxx(uint16_t addr);
-    void Opcode2xxx(uint16_t addr);
-    void Opcode3xxx(uint16_t reg, uint8_t val);
-    void Opcode4xxx(uint16_t reg, uint8_t val);
-    void Opcode5xxx(uint16_t regX, uint16_t regY);
-    void Opcode6xxx(uint16_t reg, uint8_t val);
-    void Opcode7xxx(uint16_t reg, uint8_t val);
-    void Opcode8xxx(uint16_t regX, uint16_t regY, uint16_t nib);
-    void Opcode9xxx(uint16_t regX, uint16_t regY);
-    void OpcodeAxxx(uint16_t addr);
-    void OpcodeBxxx(uint16_t addr);
-    void OpcodeCxxx(uint16_t reg, uint8_t val);
-    void OpcodeDxxx(uint16_t regX, uint16_t regY, uint16_t nib);
-    void OpcodeExxx(uint16_t reg, uint16_t nib);
-    void OpcodeFxxx(uint16_t reg, uint16_t nib);
-};
-
-Chip8::Chip8() : I(0), pc(START_ADDR), sp(0), delay_timer(0), sound_timer(0), drawFlag(false) {
-    Reset();
+#if CHIP8_HAVE_JIT
+
+// Saved regions live in jit-<rom hash>-<quirks>-v<JIT_VERSION>.bin. The
+// file is mapped read-only; a region is copied out of it only when every
+// guest word it was compiled from still holds the same opcode.
+void Chip8::OpenJitCache() {
+    if (romSize == 0) return;
+    std::string dir = CacheDirectory();
+    if (dir.empty()) return;
+    char name[64];
+    snprintf(name, sizeof(name), "/jit-%016llx-%s-v%d.bin", static_cast<unsigned long long>(romHash),
+             QuirksName(quirks), JIT_VERSION);
+    jit->path = dir + name;
+
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(this);
+    JitDiskHeader& h = jit->header;
+    memcpy(h.magic, "catemujt", sizeof(h.magic));
+    h.version = JIT_VERSION;
+    h.quirks  = static_cast<uint32_t>(quirks);
+    h.romHash = romHash;
+    h.offV    = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(V) - base);
+    h.offI    = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(&I) - base);
+    h.offPc   = static_cast<int32_t>(reinterpret_cast<const uint8_t*>(&pc) - base);
+
+    int fd = open(jit->path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(JitDiskHeader)) {
+        p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) return;
+    jit->image = static_cast<const uint8_t*>(p);
+    jit->imageSize = st.st_size;
+
+    // A file from another build or layout is not an error; it is
+    // replaced on the next save.
+    const JitDiskHeader* file = reinterpret_cast<const JitDiskHeader*>(jit->image);
+    if (memcmp(file, &h, offsetof(JitDiskHeader, count)) != 0) return;
+    size_t at = sizeof(JitDiskHeader);
+    for (uint32_t i = 0; i < file->count; ++i) {
+        const JitDiskEntry* entry = reinterpret_cast<const JitDiskEntry*>(jit->image + at);
+        if (jit->imageSize - at < sizeof(JitDiskEntry) || entry->Bytes() > jit->imageSize - at ||
+            entry->size > JIT_REGION_SLACK) {
+            std::cerr << "JIT: ignoring corrupt cache " << jit->path << std::endl;
+            jit->stored.clear();
+            return;
+        }
+        jit->stored.emplace(entry->start, entry);
+        at += entry->Bytes();
+    }
 }
 
-void Chip8::Reset() {
-    std::memset(memory, 0, sizeof(memory));
-    std::memset(V, 0, sizeof(V));
-    std::memset(stack, 0, sizeof(stack));
-    std::memset(keypad, 0, sizeof(keypad));
-    std::memset(display, 0, sizeof(display));
-    std::memcpy(&memory[FONTSET_ADDR], fontset, FONTSET_SIZE);
-    pc = START_ADDR;
-    I = 0;
-    sp = 0;
-    delay_timer = 0;
-    sound_timer = 0;
-    drawFlag = false;
+const Chip8::JitRegion* Chip8::RestoreRegion(uint16_t start) {
+    auto it = jit->stored.find(start);
+    if (it == jit->stored.end()) return nullptr;
+    const JitDiskEntry* entry = it->second;
+    const uint16_t* addrs = entry->Addrs();
+    const uint16_t* opcodes = entry->Opcodes();
+    for (uint32_t i = 0; i < entry->marked + entry->checked; ++i) {
+        if (addrs[i] + 1u >= memSize || ReadOpcode(addrs[i]) != opcodes[i]) return nullptr;
+    }
+    if (entry->size > JIT_CODE_SIZE - jit->used) return nullptr;
+
+    for (uint32_t i = 0; i < entry->marked; ++i) jit->code.MarkInstr(addrs[i]);
+    memcpy(jit->buffer + jit->used, entry->Code(), entry->size);
+    JitRegion& region = jit->regions[start];
+    region.fn = reinterpret_cast<uint32_t (*)(Chip8*, uint32_t)>(jit->buffer + jit->used);
+    region.maxPath = entry->maxPath;
+    jit->used += entry->size;
+    return &region;
 }
 
-void Chip8::LoadROM(const std::string& filename) {
-    Reset();
-    std::ifstream file(filename, std::ios::binary | std::ios::ate);
-    if (!file.is_open()) {
-        std::cerr << "Error: Could not open ROM file " << filename << std::endl;
-        return;
+// The first translation of each entry point is the one kept, so a program
+// that rewrites itself saves the code it starts with.
+void Chip8::JitCache::Record(uint16_t start, const std::vector<IrOp>& steps,
+                             const std::vector<uint16_t>& checked, const Chip8& machine,
+                             uint32_t maxPath, const uint8_t* fn, uint32_t size) {
+    if (path.empty() || stored.count(start) || fresh.count(start)) return;
+    JitDiskEntry entry = {};
+    entry.start   = start;
+    entry.marked  = static_cast<uint16_t>(steps.size());
+    entry.checked = static_cast<uint16_t>(checked.size());
+    entry.maxPath = maxPath;
+    entry.size    = size;
+
+    std::vector<uint16_t> words;
+    for (const IrOp& st : steps) words.push_back(st.addr);
+    words.insert(words.end(), checked.begin(), checked.end());
+    for (size_t i = 0, n = words.size(); i < n; ++i) words.push_back(machine.ReadOpcode(words[i]));
+
+    std::vector<uint8_t>& blob = fresh[start];
+    blob.resize(entry.Bytes());
+    memcpy(blob.data(), &entry, sizeof(entry));
+    memcpy(blob.data() + sizeof(entry), words.data(), words.size() * sizeof(uint16_t));
+    memcpy(blob.data() + sizeof(entry) + words.size() * sizeof(uint16_t), fn, size);
+}
+
+// Written under a private name and renamed, like the AOT libraries.
+void Chip8::JitCache::Save() {
+    if (path.empty() || fresh.empty()) return;
+    JitDiskHeader h = header;
+    h.count = static_cast<uint32_t>(stored.size() + fresh.size());
+    std::string tmp = path + ".tmp" + std::to_string(getpid());
+    std::ofstream file(tmp, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    for (const auto& kv : fresh) {
+        file.write(reinterpret_cast<const char*>(kv.second.data()), kv.second.size());
     }
-    std::streamsize size = file.tellg();
-    file.seekg(0, std::ios::beg);
-    if (size > MEMORY_SIZE - START_ADDR) {
-        std::cerr << "Error: ROM too large" << std::endl;
-        return;
+    for (const auto& kv : stored) {
+        file.write(reinterpret_cast<const char*>(kv.second), kv.second->Bytes());
     }
-    file.read(reinterpret_cast<char*>(&memory[START_ADDR]), size);
     file.close();
+    if (!file || rename(tmp.c_str(), path.c_str()) != 0) {
+        std::cerr << "JIT: could not write " << path << std::endl;
+        unlink(tmp.c_str());
+    }
 }
 
-void Chip8::Cycle() {
-    uint16_t opcode = (memory[pc] << 8) | memory[pc + 1];
-    pc += 2;
+#endif  // CHIP8_HAVE_JIT
 
-    uint16_t nib1 = (opcode & 0xF000) >> 12;
-    uint16_t regX = (opcode & 0x0F00) >> 8;
-    uint16_t regY = (opcode & 0x00F0) >> 4;
-    uint16_t nib4 = (opcode & 0x000F);
-    uint16_t addr = (opcode & 0x0FFF);
-    uint8_t  val  = (opcode & 0x00FF);
-
-    switch (nib1) {
-        case 0x0: Opcode0xxx(opcode); break;
-        case 0x1: Opcode1xxx(addr); break;
-        case 0x2: Opcode2xxx(addr); break;
-        case 0x3: Opcode3xxx(regX, val); break;
-        case 0x4: Opcode4xxx(regX, val); break;
-        case 0x5: Opcode5xxx(regX, regY); break;
-        case 0x6: Opcode6xxx(regX, val); break;
-        case 0x7: Opcode7xxx(regX, val); break;
-        case 0x8: Opcode8xxx(regX, regY, nib4); break;
-        case 0x9: Opcode9xxx(regX, regY); break;
-        case 0xA: OpcodeAxxx(addr); break;
-        case 0xB: OpcodeBxxx(addr); break;
-        case 0xC: OpcodeCxxx(regX, val); break;
-        case 0xD: OpcodeDxxx(regX, regY, nib4); break;
-        case 0xE: OpcodeExxx(regX, val); break;
-        case 0xF: OpcodeFxxx(regX, val); break;
-        default: break;
+// ----------------------------------------------------------------------
+// Ahead-of-time static recompiler
+// ----------------------------------------------------------------------
+
+static void Appendf(std::string& out, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static void Appendf(std::string& out, const char* fmt, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    out += buf;
+}
+
+// Runs one instruction through the interpreter on behalf of generated code.
+void Chip8::AotExec(void* machine, uint16_t opcode) {
+    Chip8& chip8 = *static_cast<Chip8*>(machine);
+    chip8.handlers[opcode](chip8, DecodeInstr(opcode));
+}
+
+// A block starts wherever control arrives other than by falling through:
+// the entry, branch targets and after anything that ends a block.
+std::vector<std::vector<IrOp>> Chip8::AotBlocks(const std::vector<uint8_t>& reachable) const {
+    std::vector<uint8_t> leader(CodeSize(), 0);
+    auto mark = [&](uint32_t target) {
+        if (target < CodeSize()) leader[target] = 1;
+    };
+    mark(START_ADDR);
+    for (uint32_t a = 0; a < CodeSize(); ++a) {
+        if (!reachable[a]) continue;
+        Instr in = DecodeInstr(ReadOpcode(a));
+        uint8_t id = ids[in.opcode];
+        if (id == OP_1NNN || id == OP_2NNN) mark(in.nnn);
+        if (IsSkip(id)) mark(a + SkipLength(a));
+        if (id == OP_F000 || id == OP_01NN) mark(a + 4);
+        if (EndsBlock(id)) mark(a + 2);
+        // Falling off the walk ends the block and exits to the interpreter.
+        else if (a + 2u < CodeSize() && !reachable[a + 2]) mark(a + 2);
+    }
+    std::vector<std::vector<IrOp>> blocks;
+    for (uint32_t a = 0; a < CodeSize(); ++a) {
+        if (!reachable[a] || !leader[a]) continue;
+        blocks.push_back(TranslateIr(static_cast<uint16_t>(a), leader.data()));
+        std::vector<IrOp>& ops = blocks.back();
+        // A block cut short by MAX_BLOCK_OPS falls into a new one.
+        if (!EndsBlock(ops.back().id)) mark(ops.back().addr + 2);
     }
+    return blocks;
 }
 
-void Chip8::UpdateTimers() {
-    if (delay_timer > 0) delay_timer--;
-    if (sound_timer > 0) sound_timer--;
+// One C++ function for the whole ROM: a label per block, optimised as an
+// IR list as the other engines' are, a switch on pc for indirect entry,
+// and V/I/sp held in locals so the compiler can keep them in registers.
+// Dxyn, Cxkk and the memory ops call back into the interpreter, as do
+// 00E0, Fx18 and the SUPER-CHIP display ops so they can raise stop
+// events; Fx0A and unknown targets return to it.
+std::string Chip8::GenerateAotSource(const std::vector<std::vector<IrOp>>& blocks) const {
+    const QuirkFlags quirkFlags = FlagsOf(quirks);
+    const char* reset = quirkFlags.vfReset ? " v15 = 0;" : "";
+    std::vector<uint8_t> starts(CodeSize(), 0);
+    for (const std::vector<IrOp>& ops : blocks) starts[ops[0].addr] = 1;
+
+    std::string out;
+    Appendf(out, "// Generated by Cat's emu for ROM %016llx (%s quirks); do not edit.\n",
+            static_cast<unsigned long long>(romHash), QuirksName(quirks));
+    out += "#include <stdint.h>\n#include <string.h>\n";
+    out += AOT_STATE_SOURCE;
+    out += "\n\n";
+    Appendf(out, "extern \"C\" const int chip8_aot_version = %d;\n\n", AOT_VERSION);
+    out += "#define SYNC_OUT()";
+    for (int r = 0; r < 16; ++r) Appendf(out, " s->V[%d] = v%d;", r, r);
+    out += " *s->I = i; *s->sp = sp;\n";
+    out += "#define SYNC_IN()";
+    for (int r = 0; r < 16; ++r) Appendf(out, " v%d = s->V[%d];", r, r);
+    out += " i = *s->I; sp = *s->sp;\n\n";
+
+    out += "extern \"C\" uint32_t chip8_aot_run(AotState* s, uint32_t budget) {\n";
+    out += "    unsigned v0, v1, v2, v3, v4, v5, v6, v7, v8, v9, v10, v11, v12, v13, v14, v15;\n";
+    out += "    unsigned i, sp;\n";
+    out += "    unsigned pc = *s->pc;\n";
+    out += "    SYNC_IN();\n";
+    Appendf(out, "dispatch:\n    switch (pc & 0x%X) {\n", memSize - 1);
+    for (const std::vector<IrOp>& ops : blocks) {
+        Appendf(out, "    case 0x%03X: goto L%03X;\n", ops[0].addr, ops[0].addr);
+        for (size_t k = 1; k < ops.size(); ++k) Appendf(out, "    case 0x%03X: goto P%03X;\n", ops[k].addr, ops[k].addr);
+    }
+    out += "    default: goto out;\n    }\n";
+
+    auto jump = [&](uint32_t target) {
+        std::string j;
+        if (target < CodeSize() && starts[target]) Appendf(j, "goto L%03X;", target);
+        else Appendf(j, "{ pc = 0x%X; goto out; }", target);
+        return j;
+    };
+
+    // Each block twice: optimised under one budget check, and as it is
+    // with a label and a check per instruction, for the ends of batches.
+    for (const std::vector<IrOp>& plain : blocks) {
+        std::vector<IrOp> fast = plain;
+        OptimizeIr(fast, quirkFlags, false);
+        uint32_t length = static_cast<uint32_t>(plain.size());
+        for (bool exact : {false, true}) {
+            const std::vector<IrOp>& ops = exact ? plain : fast;
+            if (!exact) {
+                Appendf(out, "L%03X:\n    if (budget < %u) goto P%03X;\n    budget -= %u;\n", ops[0].addr,
+                        length, ops[0].addr, length);
+            }
+            for (uint32_t k = 0; k < length; ++k) {
+                const IrOp& op = ops[k];
+                const Instr& in = op.in;
+                uint32_t a = op.addr;
+                uint32_t left = exact ? 0 : length - k - 1;
+                int x = in.x;
+                int y = in.y;
+                int shift = quirkFlags.shiftVx ? x : y;
+                std::string next = k + 1 == length ? jump(a + 2) : "";
+                std::string skip = jump(a + SkipLength(a));
+
+                if (exact) {
+                    Appendf(out, "P%03X: /* %04X */\n", a, ReadOpcode(a));
+                    Appendf(out, "    if (!budget) { pc = 0x%03X; goto out; }\n    --budget;\n", a);
+                } else {
+                    Appendf(out, "    /* %03X: %04X */\n", a, ReadOpcode(a));
+                }
+                if (op.flags & IR_DEAD) continue;
+                if (op.flags & IR_NO_VF) {
+                    switch (op.id) {
+                        case OP_8XY1: Appendf(out, "    v%d |= v%d;\n", x, y); break;
+                        case OP_8XY2: Appendf(out, "    v%d &= v%d;\n", x, y); break;
+                        case OP_8XY3: Appendf(out, "    v%d ^= v%d;\n", x, y); break;
+                        case OP_8XY4: Appendf(out, "    v%d = (v%d + v%d) & 0xFF;\n", x, x, y); break;
+                        case OP_8XY5: Appendf(out, "    v%d = (v%d - v%d) & 0xFF;\n", x, x, y); break;
+                        case OP_8XY6: Appendf(out, "    v%d = v%d >> 1;\n", x, shift); break;
+                        case OP_8XY7: Appendf(out, "    v%d = (v%d - v%d) & 0xFF;\n", x, y, x); break;
+                        case OP_8XYE: Appendf(out, "    v%d = (v%d << 1) & 0xFF;\n", x, shift); break;
+                    }
+                    if (!next.empty()) Appendf(out, "    %s\n", next.c_str());
+                    continue;
+                }
+                switch (op.id) {
+                    case OP_00EE:
+                        Appendf(out, "    *s->faults += sp == 0; sp = (sp - 1) & 0xFF; pc = s->stack[sp & 0x%X];"
+                                " goto dispatch;\n", STACK_SIZE - 1);
+                        continue;
+                    case OP_1NNN:
+                        Appendf(out, "    %s\n", jump(in.nnn).c_str());
+                        continue;
+                    case OP_2NNN:
+                        Appendf(out, "    *s->faults += sp >= %d; s->stack[sp & 0x%X] = 0x%X; sp = (sp + 1) & 0xFF; %s\n",
+                                STACK_SIZE, STACK_SIZE - 1, a + 2, jump(in.nnn).c_str());
+                        continue;
+                    case OP_3XKK:
+                        Appendf(out, "    if (v%d == 0x%02X) %s\n", x, in.kk, skip.c_str());
+                        break;
+                    case OP_4XKK:
+                        Appendf(out, "    if (v%d != 0x%02X) %s\n", x, in.kk, skip.c_str());
+                        break;
+                    case OP_5XY0:
+                        Appendf(out, "    if (v%d == v%d) %s\n", x, y, skip.c_str());
+                        break;
+                    case OP_9XY0:
+                        Appendf(out, "    if (v%d != v%d) %s\n", x, y, skip.c_str());
+                        break;
+                    case OP_6XKK: Appendf(out, "    v%d = 0x%02X;\n", x, in.kk); break;
+                    case OP_7XKK: Appendf(out, "    v%d = (v%d + 0x%02X) & 0xFF;\n", x, x, in.kk); break;
+                    case OP_8XY0: Appendf(out, "    v%d = v%d;\n", x, y); break;
+                    case OP_8XY1: Appendf(out, "    v%d |= v%d;%s\n", x, y, reset); break;
+                    case OP_8XY2: Appendf(out, "    v%d &= v%d;%s\n", x, y, reset); break;
+                    case OP_8XY3: Appendf(out, "    v%d ^= v%d;%s\n", x, y, reset); break;
+                    // VF is written before the result, as in the interpreter.
+                    case OP_8XY4:
+                        Appendf(out, "    { unsigned sum = v%d + v%d; v15 = sum > 0xFF; v%d = sum & 0xFF; }\n",
+                                x, y, x);
+                        break;
+                    case OP_8XY5:
+                        Appendf(out, "    v15 = v%d > v%d; v%d = (v%d - v%d) & 0xFF;\n", x, y, x, x, y);
+                        break;
+                    case OP_8XY6:
+                        Appendf(out, "    v15 = v%d & 1; v%d = v%d >> 1;\n", shift, x, shift);
+                        break;
+                    case OP_8XY7:
+                        Appendf(out, "    v15 = v%d > v%d; v%d = (v%d - v%d) & 0xFF;\n", y, x, x, y, x);
+                        break;
+                    case OP_8XYE:
+                        Appendf(out, "    v15 = (v%d & 0x80) >> 7; v%d = (v%d << 1) & 0xFF;\n", shift, x, shift);
+                        break;
+                    case OP_ANNN: Appendf(out, "    i = 0x%03X;\n", in.nnn); break;
+                    case OP_BNNN:
+                        Appendf(out, "    pc = (0x%03X + v%d) & 0xFFFF; goto dispatch;\n", in.nnn,
+                                quirkFlags.jumpVx ? x : 0);
+                        continue;
+                    case OP_EX9E:
+                        Appendf(out, "    *s->faults += v%d > 0xF; if (s->keypad[v%d & 0xF]) %s\n", x, x,
+                                skip.c_str());
+                        break;
+                    case OP_EXA1:
+                        Appendf(out, "    *s->faults += v%d > 0xF; if (!s->keypad[v%d & 0xF]) %s\n", x, x,
+                                skip.c_str());
+                        break;
+                    case OP_FX07: Appendf(out, "    v%d = *s->delay_timer;\n", x); break;
+                    case OP_FX15: Appendf(out, "    *s->delay_timer = v%d;\n", x); break;
+                    case OP_FX1E:
+                        Appendf(out, "    i = (i + v%d) & 0x%X;\n", x, quirkFlags.megaChip ? 0xFFFFFF : 0xFFFF);
+                        break;
+                    case OP_FX29: Appendf(out, "    i = (0x%X + v%d * 5) & 0xFFFF;\n", FONTSET_ADDR, x); break;
+                    case OP_FX0A:
+                        Appendf(out, "    pc = 0x%03X; budget += %u; goto out;\n", a, left + 1);
+                        continue;
+                    case OP_00FD:
+                        Appendf(out, "    %s\n", jump(a).c_str());
+                        continue;
+                    case OP_F000:
+                        Appendf(out, "    i = 0x%04X; %s\n", ReadOpcode(a + 2), jump(a + 4).c_str());
+                        continue;
+                    case OP_01NN:
+                        Appendf(out, "    i = 0x%06X; %s\n", in.kk << 16 | ReadOpcode(a + 2), jump(a + 4).c_str());
+                        continue;
+                    case OP_00E0: case OP_CXKK: case OP_DXYN: case OP_FX18:
+                    case OP_FX33: case OP_FX55: case OP_FX65:
+                    case OP_00CN: case OP_00FB: case OP_00FC: case OP_00FE: case OP_00FF:
+                    case OP_FX30: case OP_FX75: case OP_FX85:
+                    case OP_00DN: case OP_5XY2: case OP_5XY3: case OP_FN01: case OP_F002: case OP_FX3A:
+                    case OP_001N: case OP_00BN: case OP_0XNN:
+                        Appendf(out, "    SYNC_OUT(); *s->pc = 0x%X; s->exec(s->machine, 0x%04X); SYNC_IN();\n",
+                                a + 2, in.opcode);
+                        Appendf(out, "    if (*s->stale || *s->stop) {");
+                        if (left) Appendf(out, " budget += %u;", left);
+                        Appendf(out, " pc = 0x%X; goto out; }\n", a + 2);
+                        break;
+                    default:
+                        break;
+                }
+                if (!next.empty()) Appendf(out, "    %s\n", next.c_str());
+            }
+        }
+    }
+
+    out += "out:\n    SYNC_OUT();\n    *s->pc = pc;\n    return budget;\n}\n";
+    return out;
 }
 
-void Chip8::Opcode0xxx(uint16_t opcode) {
-    if (opcode == 0x00E0) {
-        std::memset(display, 0, sizeof(display));
-        drawFlag = true;
-    } else if (opcode == 0x00EE) {
-        pc = stack[--sp];
-    }
-}
-
-void Chip8::Opcode1xxx(uint16_t addr) { pc = addr; }
-void Chip8::Opcode2xxx(uint16_t addr) { stack[sp++] = pc; pc = addr; }
-void Chip8::Opcode3xxx(uint16_t reg, uint8_t val) { if (V[reg] == val) pc += 2; }
-void Chip8::Opcode4xxx(uint16_t reg, uint8_t val) { if (V[reg] != val) pc += 2; }
-void Chip8::Opcode5xxx(uint16_t regX, uint16_t regY) { if (V[regX] == V[regY]) pc += 2; }
-void Chip8::Opcode6xxx(uint16_t reg, uint8_t val) { V[reg] = val; }
-void Chip8::Opcode7xxx(uint16_t reg, uint8_t val) { V[reg] += val; }
-void Chip8::OpcodeAxxx(uint16_t addr) { I = addr; }
-void Chip8::OpcodeBxxx(uint16_t addr) { pc = addr + V[0]; }
-void Chip8::OpcodeCxxx(uint16_t reg, uint8_t val) { V[reg] = (rand() % 256) & val; }
-
-void Chip8::Opcode8xxx(uint16_t regX, uint16_t regY, uint16_t nib) {
-    switch (nib) {
-        case 0x0: V[regX] = V[regY]; break;
-        case 0x1: V[regX] |= V[regY]; break;
-        case 0x2: V[regX] &= V[regY]; break;
-        case 0x3: V[regX] ^= V[regY]; break;
-        case 0x4: {
-            uint16_t sum = V[regX] + V[regY];
-            V[0xF] = (sum > 0xFF) ? 1 : 0;
-            V[regX] = sum & 0xFF;
-            break;
+void Chip8::LoadAot() {
+#if CHIP8_HAVE_AOT
+    if (romSize == 0) return;
+
+    // Everything reachable from START_ADDR by direct control flow within
+    // the loaded image. BNNN targets and 00EE returns are resolved through
+    // the switch at run time; 0000, unknown opcodes and anything outside
+    // the image are left to the interpreter.
+    std::vector<uint8_t> reachable(CodeSize(), 0);
+    std::vector<uint32_t> work(1, START_ADDR);
+    uint32_t end = std::min<uint32_t>(START_ADDR + romSize, CodeSize());
+    while (!work.empty()) {
+        uint32_t a = work.back();
+        work.pop_back();
+        if (a < START_ADDR || a + 1u >= end || reachable[a]) continue;
+        uint16_t opcode = ReadOpcode(a);
+        if (opcode == 0x0000 || ids[opcode] == OP_NOP) continue;
+        reachable[a] = 1;
+        aot->code.MarkInstr(a);
+
+        Instr in = DecodeInstr(opcode);
+        switch (ids[opcode]) {
+            case OP_1NNN: work.push_back(in.nnn); break;
+            case OP_2NNN: work.push_back(in.nnn); work.push_back(a + 2); break;
+            case OP_3XKK: case OP_4XKK: case OP_5XY0: case OP_9XY0:
+            case OP_EX9E: case OP_EXA1:
+                work.push_back(a + 2);
+                work.push_back(a + SkipLength(a));
+                break;
+            case OP_F000: case OP_01NN:
+                // NNNN is baked into the module.
+                aot->code.MarkInstr(a + 2);
+                work.push_back(a + 4);
+                break;
+            case OP_00EE: case OP_BNNN: case OP_00FD: break;
+            default: work.push_back(a + 2); break;
         }
-        case 0x5: {
-            V[0xF] = (V[regX] > V[regY]) ? 1 : 0;
-            V[regX] -= V[regY];
-            break;
+    }
+    std::string dir = CacheDirectory();
+    if (dir.empty()) {
+        std::cerr << "AOT: no cache directory, using interpreter" << std::endl;
+        return;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "/aot-%016llx-%s-v%d", static_cast<unsigned long long>(romHash),
+             QuirksName(quirks), AOT_VERSION);
+    std::string base = dir + name;
+    std::string lib = base + ".so";
+
+    if (access(lib.c_str(), R_OK) != 0) {
+        std::string code = GenerateAotSource(AotBlocks(reachable));
+        if (code.size() > AOT_MAX_SOURCE) {
+            std::cerr << "AOT: ROM too large to translate, using interpreter" << std::endl;
+            return;
         }
-        case 0x6: {
-            V[0xF] = V[regY] & 0x01;
-            V[regX] = V[regY] >> 1;
-            break;
+
+        // Write and build under private names and rename, so concurrent
+        // processes never compile or dlopen a half-written file.
+        std::string pid = std::to_string(getpid());
+        std::string src = base + ".tmp" + pid + ".cpp";
+        std::ofstream file(src);
+        file << code;
+        file.close();
+        if (!file) {
+            std::cerr << "AOT: could not write " << src << std::endl;
+            unlink(src.c_str());
+            return;
         }
-        case 0x7: {
-            V[0xF] = (V[regY] > V[regX]) ? 1 : 0;
-            V[regX] = V[regY] - V[regX];
-            break;
+        std::string tmp = lib + ".tmp" + pid;
+        const char* cxx = std::getenv("CXX");
+        std::string cmd = std::string(cxx ? cxx : "c++") + " -O2 -shared -fPIC -o '" + tmp +
+                          "' '" + src + "'";
+        bool built = std::system(cmd.c_str()) == 0 && rename(tmp.c_str(), lib.c_str()) == 0;
+        unlink(src.c_str());
+        if (!built) {
+            std::cerr << "AOT: compile failed, using interpreter" << std::endl;
+            unlink(tmp.c_str());
+            return;
         }
-        case 0xE: {
-            V[0xF] = (V[regY] & 0x80) >> 7;
-            V[regX] = V[regY] << 1;
-            break;
+    }
+
+    aot->handle = dlopen(lib.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!aot->handle) {
+        std::cerr << "AOT: " << dlerror() << std::endl;
+        return;
+    }
+    const int* version = static_cast<const int*>(dlsym(aot->handle, "chip8_aot_version"));
+    void* run = dlsym(aot->handle, "chip8_aot_run");
+    if (!version || *version != AOT_VERSION || !run) {
+        std::cerr << "AOT: stale artifact " << lib << std::endl;
+        return;
+    }
+    aot->run = reinterpret_cast<AotRunFn>(run);
+    aot->state = {V, &I, &pc, &sp, stack, &delay_timer, &sound_timer, keypad, display[0], &drawFlag,
+                  &faults, &aot->code.dirty, &stopHit, this, &Chip8::AotExec};
+#endif
+}
+
+uint32_t Chip8::RunAot(uint32_t count) {
+    if (!aot) {
+        aot.reset(new AotModule);
+        LoadAot();
+    }
+    // Once guest code rewrites itself the module no longer matches memory;
+    // stay on the interpreter until the next ROM load.
+    while (count > 0 && aot->run && !aot->code.dirty) {
+        count = aot->run(&aot->state, count);
+        if (count == 0 || aot->code.dirty || stopHit) return count;
+        // Returned on an instruction it does not own (Fx0A, an indirect
+        // target outside the walked code).
+        StepPredecoded();
+        --count;
+        if (stopHit) return count;
+    }
+    while (count > 0) {
+        StepPredecoded();
+        --count;
+        if (stopHit) break;
+    }
+    return count;
+}
+
+// ----------------------------------------------------------------------
+// CDP1802 low-level engine
+// ----------------------------------------------------------------------
+// Runs the COSMAC VIP's own CHIP-8 interpreter on an emulated 1802, as an
+// accuracy reference for the other engines. Neither ROM image ships with
+// the emulator; LoadVipImages() reads dumps of them. A cycle here is an
+// 1802 machine cycle, DMA and interrupt cycles included, and a frame is
+// one 1861 field. The interpreter's registers are mirrored into V, I, pc
+// and the timers after every batch.
+std::vector<uint8_t> Chip8::Cosmac::monitor;
+std::vector<uint8_t> Chip8::Cosmac::interpreter;
+
+enum VipEventKind : uint8_t { VIP_EF1_ON, VIP_EF1_OFF, VIP_INT, VIP_DMA, VIP_FRAME_END };
+struct VipEvent {
+    uint16_t at;    // machine cycle within the frame
+    uint8_t  kind;
+    uint8_t  line;  // display line, for VIP_DMA
+};
+constexpr int VIP_EVENT_COUNT = VIP_DISPLAY_LINES + 6;
+struct VipSchedule {
+    VipEvent events[VIP_EVENT_COUNT];
+};
+
+// One 1861 frame in time order, ending with VIP_FRAME_END.
+static constexpr VipSchedule MakeVipSchedule() {
+    VipSchedule schedule{};
+    int n = 0;
+    auto add = [&](int at, VipEventKind kind, int line) {
+        schedule.events[n++] = {static_cast<uint16_t>(at), kind, static_cast<uint8_t>(line)};
+    };
+    int end = VIP_DISPLAY_LINE + VIP_DISPLAY_LINES;
+    add((VIP_DISPLAY_LINE - 4) * VIP_LINE_CYCLES, VIP_EF1_ON, 0);
+    add(VIP_INT_LINE * VIP_LINE_CYCLES, VIP_INT, 0);
+    add(VIP_DISPLAY_LINE * VIP_LINE_CYCLES, VIP_EF1_OFF, 0);
+    add((end - 4) * VIP_LINE_CYCLES, VIP_EF1_ON, 0);
+    add(end * VIP_LINE_CYCLES, VIP_EF1_OFF, 0);
+    for (int line = 0; line < VIP_DISPLAY_LINES; ++line)
+        add((VIP_DISPLAY_LINE + line) * VIP_LINE_CYCLES + VIP_DMA_OFFSET, VIP_DMA, line);
+    add(VIP_CYCLES_PER_FRAME, VIP_FRAME_END, 0);
+    for (int i = 1; i < n; ++i) {
+        for (int j = i; j > 0 && schedule.events[j - 1].at > schedule.events[j].at; --j)
+            std::swap(schedule.events[j - 1], schedule.events[j]);
+    }
+    return schedule;
+}
+static constexpr VipSchedule VIP_SCHEDULE = MakeVipSchedule();
+static_assert(VIP_SCHEDULE.events[VIP_EVENT_COUNT - 1].kind == VIP_FRAME_END);
+
+bool Chip8::LoadVipImages(const std::string& monitor, const std::string& interpreter) {
+    auto read = [](const std::string& path, std::vector<uint8_t>& out) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Error: Could not open VIP image " << path << std::endl;
+            return false;
         }
+        out.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    };
+    if (!read(monitor, Cosmac::monitor) || !read(interpreter, Cosmac::interpreter)) return false;
+    if (Cosmac::monitor.size() != VIP_MONITOR_SIZE) {
+        std::cerr << "Error: VIP monitor image must be " << VIP_MONITOR_SIZE << " bytes" << std::endl;
+        Cosmac::monitor.clear();
+        return false;
+    }
+    if (Cosmac::interpreter.empty() || Cosmac::interpreter.size() > START_ADDR) {
+        std::cerr << "Error: CHIP-8 interpreter image must fit below 0x200" << std::endl;
+        Cosmac::interpreter.clear();
+        return false;
+    }
+    return true;
+}
+
+// Branch conditions. 3N and the long branches test the condition in the
+// low three bits and negate it when bit 3 is set; CN skips have their own.
+bool Chip8::Cosmac::Ef(int n) const {
+    switch (n) {
+        case 1: return ef1;
+        case 3: return keypad[keyLatch];
+        default: return false;  // EF2 is the tape input, EF4 the IN button
+    }
+}
+
+void Chip8::Cosmac::Output(int port, uint8_t value) {
+    if (port == 1) {
+        displayOn = false;
+        ef1 = false;
+    } else if (port == 2) {
+        keyLatch = value & 0xF;
     }
 }
 
-void Chip8::Opcode9xxx(uint16_t regX, uint16_t regY) {
-    if (V[regX] != V[regY]) pc += 2;
+uint8_t Chip8::Cosmac::Input(int port) {
+    if (port == 1) displayOn = true;
+    return 0;
 }
 
-void Chip8::OpcodeDxxx(uint16_t regX, uint16_t regY, uint16_t nib) {
-    uint8_t x = V[regX] % DISPLAY_WIDTH;
-    uint8_t y = V[regY] % DISPLAY_HEIGHT;
-    V[0xF] = 0;
+void Chip8::Cosmac::Interrupt() {
+    T = static_cast<uint8_t>(X << 4 | P);
+    X = 2;
+    P = 1;
+    IE = false;
+    idle = false;
+    intPending = false;
+    now += 1;
+}
 
-    for (int row = 0; row < nib; ++row) {
-        if (y + row >= DISPLAY_HEIGHT) break;
-        uint8_t sprite_byte = memory[I + row];
-        for (int col = 0; col < 8; ++col) {
-            if (x + col >= DISPLAY_WIDTH) break;
-            uint8_t sprite_pixel = (sprite_byte >> (7 - col)) & 0x01;
-            int idx = (y + row) * DISPLAY_WIDTH + (x + col);
-            if (sprite_pixel) {
-                if (display[idx] == 1) V[0xF] = 1;
-                display[idx] ^= 1;
-            }
+// Eight bytes from R0, one line of 64 pixels. The interpreter repeats each
+// row over four lines, so line / 4 is the CHIP-8 row.
+void Chip8::Cosmac::Dma(int line) {
+    uint64_t row = 0;
+    for (int b = 0; b < 8; ++b) row = row << 8 | Read(R[0]++);
+    display[line >> 2] = row;
+    idle = false;
+    now += 8;
+}
+
+template <uint8_t OP>
+void Chip8::Cosmac::Exec(Cosmac& c) {
+    constexpr int N = OP & 0xF;
+    constexpr int HI = OP >> 4;
+    auto test = [&c](int cond) {
+        switch (cond & 7) {
+            case 0: return true;
+            case 1: return c.Q;
+            case 2: return c.D == 0;
+            case 3: return c.DF;
+            default: return c.Ef((cond & 7) - 3);
+        }
+    };
+    if constexpr (OP == 0x00) {                     // IDL
+        c.idle = true;
+        c.limit = 0;
+    } else if constexpr (HI == 0x0) {               // LDN
+        c.D = c.Read(c.R[N]);
+    } else if constexpr (HI == 0x1) {               // INC
+        ++c.R[N];
+    } else if constexpr (HI == 0x2) {               // DEC
+        --c.R[N];
+    } else if constexpr (HI == 0x3) {               // short branch
+        uint16_t& rp = c.R[c.P];
+        if (test(N) != ((N & 8) != 0)) rp = (rp & 0xFF00) | c.Read(rp);
+        else ++rp;
+    } else if constexpr (HI == 0x4) {               // LDA
+        c.D = c.Read(c.R[N]++);
+    } else if constexpr (HI == 0x5) {               // STR
+        c.Write(c.R[N], c.D);
+    } else if constexpr (OP == 0x60) {              // IRX
+        ++c.R[c.X];
+    } else if constexpr (OP <= 0x67) {              // OUT
+        uint8_t value = c.Read(c.R[c.X]++);
+        c.Output(N, value);
+    } else if constexpr (OP == 0x68) {              // 1804 prefix; nothing on the 1802
+    } else if constexpr (HI == 0x6) {               // INP
+        uint8_t value = c.Input(N - 8);
+        c.Write(c.R[c.X], value);
+        c.D = value;
+    } else if constexpr (OP == 0x70 || OP == 0x71) { // RET, DIS
+        uint8_t xp = c.Read(c.R[c.X]++);
+        c.X = xp >> 4;
+        c.P = xp & 0xF;
+        c.IE = OP == 0x70;
+    } else if constexpr (OP == 0x72) {              // LDXA
+        c.D = c.Read(c.R[c.X]++);
+    } else if constexpr (OP == 0x73) {              // STXD
+        c.Write(c.R[c.X]--, c.D);
+    } else if constexpr (OP == 0x74) {              // ADC
+        c.Add(c.Read(c.R[c.X]), c.D, c.DF);
+    } else if constexpr (OP == 0x75) {              // SDB
+        c.Add(c.Read(c.R[c.X]), c.D ^ 0xFF, c.DF);
+    } else if constexpr (OP == 0x76) {              // SHRC
+        bool out = c.D & 1;
+        c.D = static_cast<uint8_t>(c.DF << 7 | c.D >> 1);
+        c.DF = out;
+    } else if constexpr (OP == 0x77) {              // SMB
+        c.Add(c.D, c.Read(c.R[c.X]) ^ 0xFF, c.DF);
+    } else if constexpr (OP == 0x78) {              // SAV
+        c.Write(c.R[c.X], c.T);
+    } else if constexpr (OP == 0x79) {              // MARK
+        c.T = static_cast<uint8_t>(c.X << 4 | c.P);
+        c.Write(c.R[2]--, c.T);
+        c.X = c.P;
+    } else if constexpr (OP == 0x7A || OP == 0x7B) { // REQ, SEQ
+        bool q = OP == 0x7B;
+        if (c.Q != q) {
+            c.Q = q;
+            c.qChanged = true;
+            if (c.stopOnQ) c.limit = 0;
+        }
+    } else if constexpr (OP == 0x7C) {              // ADCI
+        c.Add(c.Read(c.R[c.P]++), c.D, c.DF);
+    } else if constexpr (OP == 0x7D) {              // SDBI
+        c.Add(c.Read(c.R[c.P]++), c.D ^ 0xFF, c.DF);
+    } else if constexpr (OP == 0x7E) {              // SHLC
+        bool out = c.D >> 7;
+        c.D = static_cast<uint8_t>(c.D << 1 | c.DF);
+        c.DF = out;
+    } else if constexpr (OP == 0x7F) {              // SMBI
+        c.Add(c.D, c.Read(c.R[c.P]++) ^ 0xFF, c.DF);
+    } else if constexpr (HI == 0x8) {               // GLO
+        c.D = static_cast<uint8_t>(c.R[N]);
+    } else if constexpr (HI == 0x9) {               // GHI
+        c.D = c.R[N] >> 8;
+    } else if constexpr (HI == 0xA) {               // PLO
+        c.R[N] = (c.R[N] & 0xFF00) | c.D;
+    } else if constexpr (HI == 0xB) {               // PHI
+        c.R[N] = static_cast<uint16_t>(c.D << 8 | (c.R[N] & 0xFF));
+    } else if constexpr (OP == 0xC4) {              // NOP
+    } else if constexpr (HI == 0xC && ((N & 4) || N == 8)) {  // long skip
+        bool taken;
+        if constexpr (N == 0xC) taken = c.IE;
+        else if constexpr (N == 0x8) taken = true;
+        else taken = test(N & 3) != ((N & 8) == 0);
+        if (taken) c.R[c.P] += 2;
+    } else if constexpr (HI == 0xC) {               // long branch
+        uint16_t& rp = c.R[c.P];
+        if (test(N & 3) != ((N & 8) != 0)) rp = static_cast<uint16_t>(c.Read(rp) << 8 | c.Read(rp + 1));
+        else rp += 2;
+    } else if constexpr (HI == 0xD) {               // SEP
+        c.P = N;
+    } else if constexpr (HI == 0xE) {               // SEX
+        c.X = N;
+    } else if constexpr (OP == 0xF6) {              // SHR
+        c.DF = c.D & 1;
+        c.D >>= 1;
+    } else if constexpr (OP == 0xFE) {              // SHL
+        c.DF = c.D >> 7;
+        c.D = static_cast<uint8_t>(c.D << 1);
+    } else {                                        // F0-F7 on M(R(X)), F8-FF immediate
+        uint8_t m = c.Read(N & 8 ? c.R[c.P]++ : c.R[c.X]);
+        switch (N & 7) {
+            case 0: c.D = m; break;                                   // LDX, LDI
+            case 1: c.D |= m; break;                                  // OR, ORI
+            case 2: c.D &= m; break;                                  // AND, ANI
+            case 3: c.D ^= m; break;                                  // XOR, XRI
+            case 4: c.Add(m, c.D, 0); break;                          // ADD, ADI
+            case 5: c.Add(m, c.D ^ 0xFF, 1); break;                   // SD, SDI
+            case 7: c.Add(c.D, m ^ 0xFF, 1); break;                   // SM, SMI
         }
     }
-    drawFlag = true;
 }
 
-void Chip8::OpcodeExxx(uint16_t reg, uint16_t nib) {
-    if (nib == 0x9E && keypad[V[reg]]) pc += 2;
-    else if (nib == 0xA1 && !keypad[V[reg]]) pc += 2;
+template <size_t... OPS>
+constexpr std::array<Chip8::Cosmac::Handler, 256> Chip8::Cosmac::MakeTable(std::index_sequence<OPS...>) {
+    return {&Exec<static_cast<uint8_t>(OPS)>...};
 }
+const std::array<Chip8::Cosmac::Handler, 256> Chip8::Cosmac::handlers =
+    MakeTable(std::make_index_sequence<256>{});
 
-void Chip8::OpcodeFxxx(uint16_t reg, uint16_t nib) {
-    switch (nib) {
-        case 0x07: V[reg] = delay_timer; break;
-        case 0x0A: {
-            bool key_pressed = false;
-            for (int i = 0; i < 16; ++i) {
-                if (keypad[i]) {
-                    V[reg] = i;
-                    key_pressed = true;
-                    break;
+// Runs whole instructions until machine cycle until, servicing the 1861 in
+// between. The inner loop only fetches and dispatches; it stops at the
+// next 1861 event, and after every instruction while an INT waits for IE.
+uint32_t Chip8::Cosmac::Run(uint64_t until) {
+    uint32_t executed = 0;
+    qChanged = false;
+    while (now < until && !(qChanged && stopOnQ)) {
+        if (intPending && IE) Interrupt();
+        const VipEvent& event = VIP_SCHEDULE.events[nextEvent];
+        uint64_t eventAt = frameStart + event.at;
+        limit = std::min(until, eventAt);
+        if (intPending) limit = std::min(limit, now + 1);
+        if (idle) now = std::max(now, limit);
+        while (now < limit) {
+            uint8_t op = Read(R[P]++);
+            handlers[op](*this);
+            now += (op >> 4) == 0xC ? 3 : 2;
+            ++executed;
+        }
+        if (now < eventAt) continue;
+        switch (event.kind) {
+            case VIP_EF1_ON:  ef1 = displayOn; break;
+            case VIP_EF1_OFF: ef1 = false; break;
+            case VIP_INT:
+                if (displayOn) {
+                    if (IE) Interrupt();
+                    else intPending = true;
                 }
-            }
-            if (!key_pressed) pc -= 2;
-            break;
+                break;
+            case VIP_DMA:
+                intPending = false;
+                if (displayOn) Dma(event.line);
+                break;
+            case VIP_FRAME_END:
+                frameStart += VIP_CYCLES_PER_FRAME;
+                nextEvent = 0;
+                continue;
         }
-        case 0x15: delay_timer = V[reg]; break;
-        case 0x18: sound_timer = V[reg]; break;
-        case 0x1E: I += V[reg]; break;
-        case 0x29: I = FONTSET_ADDR + (V[reg] * 5); break;
-        case 0x33: {
-            memory[I]     = V[reg] / 100;
-            memory[I + 1] = (V[reg] / 10) % 10;
-            memory[I + 2] = V[reg] % 10;
-            break;
+        ++nextEvent;
+    }
+    return executed;
+}
+
+// Boots the VIP from reset into the monitor, which starts the interpreter
+// at 0000 unless key C is held.
+bool Chip8::BootLle() {
+    if (Cosmac::monitor.empty() || Cosmac::interpreter.empty()) {
+        std::cerr << "LLE: no VIP ROM images loaded; using the switch engine" << std::endl;
+        engine = Engine::Switch;
+        return false;
+    }
+    std::copy(Cosmac::interpreter.begin(), Cosmac::interpreter.end(), memory);
+    lle.reset(new Cosmac(memory, display[0], keypad));
+    return true;
+}
+
+Chip8::RunResult Chip8::RunLle(uint32_t count, bool toFrameEnd, uint8_t events) {
+    if (!lle && !BootLle()) return toFrameEnd ? RunFrame(events) : RunCycles(count, events);
+    Cosmac& cpu = *lle;
+    uint64_t start = cpu.now;
+    uint64_t until = toFrameEnd ? cpu.frameStart + VIP_CYCLES_PER_FRAME : start + count;
+    cpu.stopOnQ = (events & STOP_SOUND) != 0;
+    RunResult result = {cpu.Run(until), 0, StopReason::Budget};
+    // As RunFrame(): a Q edge on the frame's last cycle still ends it.
+    bool frameDone = toFrameEnd && cpu.now >= until;
+    if (cpu.qChanged && cpu.stopOnQ && !frameDone) result.reason = StopReason::Sound;
+    cycleCount += cpu.now - start;
+
+    std::copy_n(&memory[VIP_VREG_ADDR], 16, V);
+    I = cpu.R[0xA];
+    pc = cpu.R[5];
+    delay_timer = cpu.R[8] >> 8;
+    // Q drives the speaker; the interpreter counts the tone down in R8.0.
+    sound_timer = cpu.Q ? std::max(cpu.R[8] & 0xFF, 1) : 0;
+    timerTicks = TicksAt(cycleCount);
+    std::copy_n(memory, GUARD_SIZE, &memory[memSize]);
+    if (cpu.displayOn) drawFlag = true;
+    return result;
+}
+
+// ----------------------------------------------------------------------
+// Cooperative scheduler
+// ----------------------------------------------------------------------
+// Hosts many machines on one thread. Each runs as a coroutine that runs
+// a frame at a time and suspends at the frame boundary, on a beeper edge,
+// and while halted in Fx0A; Tick() resumes every machine due a frame.
+// A halted machine costs nothing until SetKey() wakes it.
+struct MachineTask {
+    struct promise_type {
+        MachineTask get_return_object() {
+            return {std::coroutine_handle<promise_type>::from_promise(*this)};
         }
-        case 0x55: {
-            for (int i = 0; i <= reg; ++i) memory[I + i] = V[i];
-            break;
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> handle;
+};
+
+class Scheduler {
+public:
+    // Called from Tick() when a machine switches its beeper on or off.
+    using SoundFn = std::function<void(size_t id, bool on)>;
+
+    // A new machine, in its reset state, that starts running on the next
+    // Tick(); configure and load it through Get() before then.
+    size_t Add();
+    Chip8& Get(size_t id) { return machines[id]->chip8; }
+    size_t Size() const { return machines.size(); }
+    size_t Waiting() const { return waiting; }
+    uint64_t GetTick() const { return tick; }
+    uint64_t GetFrames(size_t id) const { return machines[id]->frames; }
+    bool IsWaiting(size_t id) const { return machines[id]->waitingKey; }
+    void SetSoundCallback(SoundFn fn) { onSound = std::move(fn); }
+    void SetKey(size_t id, int key, bool pressed);
+    // One frame for every machine that is not waiting on a key.
+    void Tick();
+
+private:
+    enum class Wait : uint8_t { Frame, Sound, Key };
+
+    struct Machine {
+        Chip8       chip8;
+        size_t      id;
+        MachineTask task;
+        bool        waitingKey = false;
+        bool        sound = false; // beeper state last reported
+        uint64_t    frames = 0;    // whole frames run, one per Tick() while awake
+        ~Machine() { if (task.handle) task.handle.destroy(); }
+    };
+
+    struct Suspend {
+        Scheduler& scheduler;
+        Machine&   machine;
+        Wait       wait;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<>) { scheduler.Park(machine, wait); }
+        void await_resume() const noexcept {}
+    };
+
+    static MachineTask Drive(Scheduler& scheduler, Machine& machine);
+    void Park(Machine& machine, Wait wait);
+
+    std::vector<std::unique_ptr<Machine>> machines;
+    std::vector<Machine*> nextFrame;   // due a frame on the next Tick()
+    std::vector<Machine*> runnable;    // still to resume in this Tick()
+    size_t   waiting = 0;
+    uint64_t tick = 0;
+    SoundFn  onSound;
+};
+
+MachineTask Scheduler::Drive(Scheduler& scheduler, Machine& machine) {
+    for (;;) {
+        Chip8::RunResult run = machine.chip8.RunFrame(Chip8::STOP_SOUND | Chip8::STOP_KEY_WAIT);
+        if (run.reason == Chip8::StopReason::Budget) ++machine.frames;
+        // An Fx0A on the frame's last cycle comes back as Budget.
+        if (machine.chip8.IsHalted()) run.reason = Chip8::StopReason::KeyWait;
+        switch (run.reason) {
+            case Chip8::StopReason::KeyWait: co_await Suspend{scheduler, machine, Wait::Key}; break;
+            case Chip8::StopReason::Sound:   co_await Suspend{scheduler, machine, Wait::Sound}; break;
+            default:                         co_await Suspend{scheduler, machine, Wait::Frame}; break;
         }
-        case 0x65: {
-            for (int i = 0; i <= reg; ++i) V[i] = memory[I + i];
+    }
+}
+
+size_t Scheduler::Add() {
+    auto machine = std::make_unique<Machine>();
+    machine->id = machines.size();
+    machine->frames = tick;
+    machine->task = Drive(*this, *machine);
+    nextFrame.push_back(machine.get());
+    machines.push_back(std::move(machine));
+    return machines.size() - 1;
+}
+
+void Scheduler::Park(Machine& machine, Wait wait) {
+    // Edges are reported on any wait: one on the frame's last cycle ends
+    // the frame rather than raising Sound.
+    bool sound = machine.chip8.GetSoundState();
+    if (sound != machine.sound) {
+        machine.sound = sound;
+        if (onSound) onSound(machine.id, sound);
+    }
+    switch (wait) {
+        case Wait::Frame:
+            nextFrame.push_back(&machine);
             break;
-        }
+        case Wait::Sound:
+            // Finishes its frame after the others.
+            runnable.push_back(&machine);
+            break;
+        case Wait::Key:
+            machine.waitingKey = true;
+            ++waiting;
+            break;
+    }
+}
+
+void Scheduler::SetKey(size_t id, int key, bool pressed) {
+    Machine& machine = *machines[id];
+    if (machine.waitingKey) {
+        // Bring its timers up to now before the key can end the halt, as
+        // the main loop does after sleeping.
+        for (uint64_t f = std::min<uint64_t>(tick - std::min(tick, machine.frames), 255); f > 0; --f)
+            machine.chip8.RunFrame(0);
+        machine.frames = tick;
     }
+    machine.chip8.SetKey(key, pressed);
+    if (machine.waitingKey && !machine.chip8.IsHalted()) {
+        machine.waitingKey = false;
+        --waiting;
+        nextFrame.push_back(&machine);
+    }
+}
+
+void Scheduler::Tick() {
+    std::swap(runnable, nextFrame);
+    for (size_t i = 0; i < runnable.size(); ++i) runnable[i]->task.handle.resume();
+    runnable.clear();
+    ++tick;
 }
 
 // ----------------------------------------------------------------------
@@ -318,6 +4949,7 @@ public:
 private:
     SDL_Window* window;
     SDL_Renderer* renderer;
+    SDL_Texture* megaTexture;  // created on the first MegaChip frame
     TTF_Font* fontSmall;
     TTF_Font* fontMedium;
     SDL_Color white;
@@ -335,7 +4967,7 @@ private:
     void DrawBorder();
 };
 
-GUI::GUI() : window(nullptr), renderer(nullptr), fontSmall(nullptr), fontMedium(nullptr),
+GUI::GUI() : window(nullptr), renderer(nullptr), megaTexture(nullptr), fontSmall(nullptr), fontMedium(nullptr),
              menuOpen(false), showAbout(false), showControls(false) {
     white = {255, 255, 255, 255};
     black = {0, 0, 0, 255};
@@ -347,6 +4979,7 @@ GUI::GUI() : window(nullptr), renderer(nullptr), fontSmall(nullptr), fontMedium(
 GUI::~GUI() {
     if (fontSmall) TTF_CloseFont(fontSmall);
     if (fontMedium) TTF_CloseFont(fontMedium);
+    if (megaTexture) SDL_DestroyTexture(megaTexture);
     if (renderer) SDL_DestroyRenderer(renderer);
     if (window) SDL_DestroyWindow(window);
 }
@@ -478,20 +5111,41 @@ void GUI::Render(const Chip8& chip8, float fps, const std::string& romName) {
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderClear(renderer);
 
-    // Draw game screen
-    const uint8_t* display = chip8.GetDisplay();
-    for (int y = 0; y < DISPLAY_HEIGHT; ++y) {
-        for (int x = 0; x < DISPLAY_WIDTH; ++x) {
-            if (display[y * DISPLAY_WIDTH + x]) {
-                SDL_Rect rect = {
-                    GAME_X_OFFSET + x * SCALE_FACTOR,
-                    GAME_Y_OFFSET + y * SCALE_FACTOR,
-                    SCALE_FACTOR,
-                    SCALE_FACTOR
-                };
-                SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-                SDL_RenderFillRect(renderer, &rect);
-            }
+    // MegaChip draws through a texture, 4:3 inside the game area
+    if (chip8.IsMegaChip()) {
+        if (!megaTexture) {
+            megaTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                            MEGA_WIDTH, MEGA_HEIGHT);
+        }
+        static uint32_t argb[MEGA_WIDTH * MEGA_HEIGHT];
+        const uint8_t* screen = chip8.GetMegaScreen();
+        const uint32_t* palette = chip8.GetMegaPalette();
+        for (int i = 0; i < MEGA_WIDTH * MEGA_HEIGHT; ++i) argb[i] = palette[screen[i]] | 0xFF000000u;
+        SDL_UpdateTexture(megaTexture, nullptr, argb, MEGA_WIDTH * 4);
+        int w = GAME_HEIGHT * MEGA_WIDTH / MEGA_HEIGHT;
+        SDL_Rect dst = {GAME_X_OFFSET + (GAME_WIDTH - w) / 2, GAME_Y_OFFSET, w, GAME_HEIGHT};
+        SDL_RenderCopy(renderer, megaTexture, nullptr, &dst);
+        DrawMenuBar();
+        DrawBorder();
+        DrawStatusBar(fps, romName);
+        SDL_RenderPresent(renderer);
+        return;
+    }
+
+    // Draw game screen, one colour per combination of the two planes
+    uint8_t pixels[HIRES_WIDTH * HIRES_HEIGHT];
+    chip8.Compose(pixels);
+    int width = chip8.IsHires() ? HIRES_WIDTH : DISPLAY_WIDTH;
+    int height = chip8.IsHires() ? HIRES_HEIGHT : DISPLAY_HEIGHT;
+    int scale = SCALE_FACTOR * DISPLAY_WIDTH / width;
+    const SDL_Color palette[4] = {black, white, grey, highlight};
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint8_t c = pixels[y * width + x];
+            if (!c) continue;
+            SDL_Rect rect = {GAME_X_OFFSET + x * scale, GAME_Y_OFFSET + y * scale, scale, scale};
+            SDL_SetRenderDrawColor(renderer, palette[c].r, palette[c].g, palette[c].b, 255);
+            SDL_RenderFillRect(renderer, &rect);
         }
     }
 
@@ -512,18 +5166,234 @@ void GUI::UpdateTitle(float fps) {
 // ----------------------------------------------------------------------
 // Audio callback
 // ----------------------------------------------------------------------
+// Shared with the callback under SDL_LockAudio. XO-CHIP ROMs play their
+// own 128-bit pattern; everything else gets the fixed square wave.
+struct AudioState {
+    bool active = false;
+    bool pattern = false;
+    uint8_t bits[AUDIO_PATTERN_SIZE] = {};
+    double step = 0;  // pattern bits per output sample
+};
+
 void audio_callback(void* userdata, Uint8* stream, int len) {
     static int phase = 0;
-    bool* beep_active = static_cast<bool*>(userdata);
+    static double position = 0;
+    AudioState* state = static_cast<AudioState*>(userdata);
     for (int i = 0; i < len; ++i) {
-        stream[i] = (*beep_active) ? ((phase++ / 50) % 2 ? 255 : 0) : 0;
+        if (!state->active) {
+            stream[i] = 0;
+        } else if (state->pattern) {
+            int bit = static_cast<int>(position);
+            stream[i] = state->bits[bit >> 3] >> (7 - (bit & 7)) & 1 ? 255 : 0;
+            position += state->step;
+            if (position >= AUDIO_PATTERN_SIZE * 8) position -= AUDIO_PATTERN_SIZE * 8;
+        } else {
+            stream[i] = (phase++ / 50) % 2 ? 255 : 0;
+        }
+    }
+}
+
+static void PrintUsage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [options] [rom]\n"
+              << "  --engine=NAME   switch|table|threaded|predecode|block|jit|aot|lle\n"
+              << "  --bench=CYCLES  run headless and report throughput\n"
+              << "  --verify        with --bench, check every batch against the switch engine\n"
+              << "  --farm=N        run N machines on one thread and report instances per core\n"
+              << "  --no-fuse       disable superinstructions in the predecode engine\n"
+              << "  --no-idle-skip  run busy-wait loops instead of skipping them\n"
+              << "  --lazy-flags    compute VF only when read (predecode and block engines)\n"
+              << "  --quirks=NAME   legacy (default), vip, schip, xochip or megachip\n"
+              << "  --timing=NAME   flat (default) or vip: cost model for guest time\n"
+              << "  --hz=N          instructions per second under flat timing (default 700)\n"
+              << "  --seed=N        seed for Cxkk's random numbers (default 0)\n"
+              << "  --simd=NAME     scalar|sse2|avx2|avx512 pixel kernels (default: widest supported)\n"
+              << "  --vip-monitor=FILE  VIP monitor ROM dump, for --engine=lle\n"
+              << "  --vip-chip8=FILE    VIP CHIP-8 interpreter dump, for --engine=lle"
+              << std::endl;
+}
+
+// ----------------------------------------------------------------------
+// Headless benchmark
+// ----------------------------------------------------------------------
+static int RunBenchmark(Chip8& chip8, uint64_t cycles, Chip8* reference) {
+    // The reference runs every cycle so --verify also checks idle skipping.
+    if (reference) reference->SetIdleSkip(false);
+
+    // Uncapped, but in whole frames of the timing model so timers tick at
+    // the rate the ROM expects and delay loops make progress.
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    uint64_t done = 0;
+    uint64_t frames = 0;
+    while (done < cycles) {
+        if (reference) reference->RunFrame(0);
+        Chip8::RunResult run = chip8.RunFrame(0);
+        done += run.executed + run.elided;
+        ++frames;
+        if (reference && !chip8.SameState(*reference)) {
+            std::cerr << "Error: " << EngineName(chip8.GetEngine())
+                      << " diverged from switch engine in frame " << frames - 1 << std::endl;
+            return 1;
+        }
+    }
+    auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+    std::cout << EngineName(chip8.GetEngine()) << ": " << done << " cycles in "
+              << elapsed * 1000.0 << " ms (" << (elapsed > 0 ? done / elapsed / 1e6 : 0.0)
+              << " MIPS, " << chip8.GetIdleCycles() << " idle, " << frames << " "
+              << (chip8.GetEngine() == Engine::Lle ? "1861" : TimingName(chip8.GetTiming()))
+              << " frames)" << std::endl;
+    if (chip8.GetFaultCount())
+        std::cout << chip8.GetFaultCount() << " guest accesses out of range" << std::endl;
+    return 0;
+}
+
+// Ten seconds of guest time for every machine, then the instance count
+// one core could keep at 60 fps.
+static int RunFarmBenchmark(Scheduler& scheduler) {
+    constexpr int FARM_FRAMES = 10 * TIMER_HZ;
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    uint64_t done = 0;
+    for (int f = 0; f < FARM_FRAMES; ++f) scheduler.Tick();
+    auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    for (size_t id = 0; id < scheduler.Size(); ++id) done += scheduler.Get(id).GetCycleCount();
+
+    // Every machine awake runs exactly one frame per tick; one waiting on
+    // a key is caught up when the key arrives.
+    for (size_t id = 0; id < scheduler.Size(); ++id) {
+        uint64_t frames = scheduler.GetFrames(id);
+        if (frames > scheduler.GetTick() || (!scheduler.IsWaiting(id) && frames != scheduler.GetTick())) {
+            std::cerr << "Error: machine " << id << " ran " << frames << " frames in "
+                      << scheduler.GetTick() << " ticks" << std::endl;
+            return 1;
+        }
     }
+
+    double perFrame = elapsed / FARM_FRAMES;
+    double perCore = perFrame > 0 ? scheduler.Size() / (perFrame * TIMER_HZ) : 0.0;
+    std::cout << EngineName(scheduler.Get(0).GetEngine()) << ": " << scheduler.Size()
+              << " machines, " << perFrame * 1000.0 << " ms per frame, " << scheduler.Waiting()
+              << " waiting on a key, " << done << " guest cycles; about "
+              << static_cast<uint64_t>(perCore) << " instances per core at " << TIMER_HZ << " fps"
+              << std::endl;
+    return 0;
 }
 
 // ----------------------------------------------------------------------
 // Main
 // ----------------------------------------------------------------------
 int main(int argc, char* argv[]) {
+    Engine engine = Engine::Switch;
+    uint64_t benchCycles = 0;
+    bool verify = false;
+    bool fuse = true;
+    bool idleSkip = true;
+    bool lazyFlags = false;
+    Quirks quirks = Quirks::Legacy;
+    Timing timing = Timing::Flat;
+    uint32_t flatHz = CPU_HZ;
+    uint64_t seed = 0;
+    size_t farmSize = 0;
+    std::string vipMonitor;
+    std::string vipInterpreter;
+    std::string currentROM;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--engine=", 0) == 0) {
+            if (!ParseEngine(arg.substr(9), engine)) {
+                std::cerr << "Error: Unknown engine " << arg.substr(9) << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg.rfind("--bench=", 0) == 0) {
+            benchCycles = std::strtoull(arg.c_str() + 8, nullptr, 10);
+        } else if (arg == "--verify") {
+            verify = true;
+        } else if (arg == "--no-fuse") {
+            fuse = false;
+        } else if (arg == "--no-idle-skip") {
+            idleSkip = false;
+        } else if (arg == "--lazy-flags") {
+            lazyFlags = true;
+        } else if (arg.rfind("--quirks=", 0) == 0) {
+            if (!ParseQuirks(arg.substr(9), quirks)) {
+                std::cerr << "Error: Unknown quirk profile " << arg.substr(9) << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg.rfind("--timing=", 0) == 0) {
+            if (!ParseTiming(arg.substr(9), timing)) {
+                std::cerr << "Error: Unknown timing model " << arg.substr(9) << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg.rfind("--hz=", 0) == 0) {
+            flatHz = static_cast<uint32_t>(std::strtoul(arg.c_str() + 5, nullptr, 10));
+        } else if (arg.rfind("--farm=", 0) == 0) {
+            farmSize = std::strtoull(arg.c_str() + 7, nullptr, 10);
+        } else if (arg.rfind("--vip-monitor=", 0) == 0) {
+            vipMonitor = arg.substr(14);
+        } else if (arg.rfind("--vip-chip8=", 0) == 0) {
+            vipInterpreter = arg.substr(12);
+        } else if (arg.rfind("--seed=", 0) == 0) {
+            seed = std::strtoull(arg.c_str() + 7, nullptr, 0);
+        } else if (arg.rfind("--simd=", 0) == 0) {
+            Simd level;
+            if (!ParseSimd(arg.substr(7), level)) {
+                std::cerr << "Error: Unknown SIMD level " << arg.substr(7) << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
+            }
+            if (!SetSimd(level)) {
+                std::cerr << "Error: This CPU cannot run " << SimdName(level) << " kernels" << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--", 0) == 0) {
+            PrintUsage(argv[0]);
+            return 1;
+        } else {
+            currentROM = arg;
+        }
+    }
+
+    if (engine == Engine::Lle && !Chip8::LoadVipImages(vipMonitor, vipInterpreter)) {
+        std::cerr << "Error: --engine=lle needs --vip-monitor and --vip-chip8" << std::endl;
+        return 1;
+    }
+
+    auto configure = [&](Chip8& machine, uint64_t machineSeed) {
+        machine.SetEngine(engine);
+        machine.SetFusion(fuse);
+        machine.SetIdleSkip(idleSkip);
+        machine.SetLazyFlags(lazyFlags);
+        machine.SetQuirks(quirks);
+        machine.SetTiming(timing, flatHz);
+        machine.SeedRandom(machineSeed);
+        if (!currentROM.empty()) {
+            machine.LoadROM(currentROM);
+        }
+    };
+
+    if (farmSize > 0) {
+        Scheduler scheduler;
+        for (size_t i = 0; i < farmSize; ++i) configure(scheduler.Get(scheduler.Add()), seed + i);
+        return RunFarmBenchmark(scheduler);
+    }
+
+    Chip8 chip8;
+    configure(chip8, seed);
+
+    if (benchCycles > 0) {
+        Chip8 reference;
+        reference.SetQuirks(quirks);
+        reference.SetTiming(timing, flatHz);
+        reference.SeedRandom(seed);
+        if (verify && !currentROM.empty()) reference.LoadROM(currentROM);
+        return RunBenchmark(chip8, benchCycles, verify ? &reference : nullptr);
+    }
+
     GUI gui;
     if (!gui.Initialize()) {
         return 1;
@@ -536,48 +5406,56 @@ int main(int argc, char* argv[]) {
     desired.channels = 1;
     desired.samples = 2048;
     desired.callback = audio_callback;
-    bool beep_active = false;
-    desired.userdata = &beep_active;
+    AudioState audio;
+    audio.pattern = FlagsOf(quirks).xoChip;
+    desired.userdata = &audio;
 
     if (SDL_OpenAudio(&desired, &obtained) < 0) {
         std::cerr << "Audio open failed: " << SDL_GetError() << std::endl;
+        obtained.freq = desired.freq;
     }
     SDL_PauseAudio(0);
 
-    Chip8 chip8;
-    std::string currentROM;
-    
-    if (argc > 1) {
-        currentROM = argv[1];
-        chip8.LoadROM(currentROM);
-    }
-
     using clock = std::chrono::steady_clock;
-    auto last_timer_update = clock::now();
     auto last_fps_update = clock::now();
     int frame_count = 0;
     float fps = 0.0f;
-    const auto cycle_duration = std::chrono::microseconds(1000000 / CPU_HZ);
+    const auto frame_period = std::chrono::microseconds(1000000 / TIMER_HZ);
+    auto next_frame = clock::now() + frame_period;
     bool quit = false;
 
     while (!quit) {
-        auto cycle_start = clock::now();
-
-        gui.HandleEvents(quit, chip8);
-
-        auto now = clock::now();
-        while (now - cycle_start < cycle_duration) {
-            chip8.Cycle();
-            now = clock::now();
+        // Halted in Fx0A with the beeper off, nothing can change until a
+        // key arrives: sleep in SDL rather than run empty frames. The
+        // timers still count down in guest time, so catch them up; they
+        // bottom out after 255 ticks, so more frames than that change nothing.
+        if (chip8.IsHalted() && !chip8.GetSoundState()) {
+            auto slept_from = clock::now();
+            SDL_WaitEventTimeout(nullptr, 1000);
+            auto slept = clock::now() - slept_from;
+            for (int64_t f = std::min<int64_t>(slept / frame_period, 255); f > 0; --f) chip8.RunFrame(0);
+            next_frame = clock::now() + frame_period;
         }
+        gui.HandleEvents(quit, chip8);
 
-        now = clock::now();
-        if (std::chrono::duration_cast<std::chrono::microseconds>(now - last_timer_update).count() >= 1000000 / TIMER_HZ) {
-            chip8.UpdateTimers();
-            last_timer_update = now;
-        }
+        // One frame of guest time, however long the timing model says the
+        // ROM's instructions take. A beeper change ends the batch early so
+        // the audio follows it without waiting for the frame.
+        Chip8::RunResult run;
+        do {
+            run = chip8.RunFrame(Chip8::STOP_SOUND);
+            SDL_LockAudio();
+            audio.active = chip8.GetSoundState();
+            std::copy_n(chip8.GetAudioPattern(), AUDIO_PATTERN_SIZE, audio.bits);
+            audio.step = chip8.GetPatternRate() / obtained.freq;
+            SDL_UnlockAudio();
+        } while (run.reason != Chip8::StopReason::Budget);
 
-        beep_active = chip8.GetSoundState();
+        // Idle loops are skipped inside the core, so this is the only wait.
+        std::this_thread::sleep_until(next_frame);
+        auto now = clock::now();
+        next_frame += frame_period;
+        if (now > next_frame) next_frame = now + frame_period;
 
         // FPS calculation
         frame_count++;